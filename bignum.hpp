@@ -0,0 +1,302 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+// Arbitrary-precision signed integer.
+// Sign-magnitude with little-endian 32-bit limbs; zero has no limbs.
+
+class BigInt {
+	bool negative = false;
+	std::vector<uint32_t> mag;
+
+	void trim() {
+		while (!mag.empty() && mag.back() == 0)
+			mag.pop_back();
+		if (mag.empty())
+			negative = false;
+	}
+
+	static int compareMag(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		if (a.size() != b.size())
+			return a.size() < b.size() ? -1 : 1;
+		for (size_t i = a.size(); i-- > 0;) {
+			if (a[i] != b[i])
+				return a[i] < b[i] ? -1 : 1;
+		}
+		return 0;
+	}
+
+	static std::vector<uint32_t> addMag(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		const std::vector<uint32_t> &l = a.size() < b.size() ? b : a;
+		const std::vector<uint32_t> &s = a.size() < b.size() ? a : b;
+		std::vector<uint32_t> r(l.size() + 1);
+		uint64_t carry = 0;
+		for (size_t i = 0; i < l.size(); ++i) {
+			uint64_t t = carry + l[i] + (i < s.size() ? s[i] : 0);
+			r[i] = static_cast<uint32_t>(t);
+			carry = t >> 32;
+		}
+		r[l.size()] = static_cast<uint32_t>(carry);
+		return r;
+	}
+
+	// Requires |a| >= |b|.
+	static std::vector<uint32_t> subMag(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		std::vector<uint32_t> r(a.size());
+		int64_t borrow = 0;
+		for (size_t i = 0; i < a.size(); ++i) {
+			int64_t t = static_cast<int64_t>(a[i]) - borrow - (i < b.size() ? b[i] : 0);
+			r[i] = static_cast<uint32_t>(t);
+			borrow = t < 0 ? 1 : 0;
+		}
+		return r;
+	}
+
+	static std::vector<uint32_t> mulMag(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		std::vector<uint32_t> r(a.size() + b.size());
+		for (size_t i = 0; i < a.size(); ++i) {
+			uint64_t carry = 0;
+			for (size_t j = 0; j < b.size(); ++j) {
+				uint64_t t = static_cast<uint64_t>(a[i]) * b[j] + r[i + j] + carry;
+				r[i + j] = static_cast<uint32_t>(t);
+				carry = t >> 32;
+			}
+			r[i + b.size()] = static_cast<uint32_t>(carry);
+		}
+		return r;
+	}
+
+	static uint32_t divModSmall(std::vector<uint32_t> &a, uint32_t d) {
+		uint64_t rem = 0;
+		for (size_t i = a.size(); i-- > 0;) {
+			uint64_t t = (rem << 32) | a[i];
+			a[i] = static_cast<uint32_t>(t / d);
+			rem = t % d;
+		}
+		return static_cast<uint32_t>(rem);
+	}
+
+	// Knuth's algorithm D. Requires b nonzero.
+	static void divModMag(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b,
+												std::vector<uint32_t> &q, std::vector<uint32_t> &r) {
+		if (compareMag(a, b) < 0) {
+			q.clear();
+			r = a;
+			return;
+		}
+		if (b.size() == 1) {
+			q = a;
+			r.assign(1, divModSmall(q, b[0]));
+			return;
+		}
+		size_t n = b.size(), m = a.size() - n;
+		int s = __builtin_clz(b[n - 1]);
+		std::vector<uint32_t> bn(n), an(a.size() + 1);
+		for (size_t i = n - 1; i > 0; --i)
+			bn[i] = (b[i] << s) | (s ? b[i - 1] >> (32 - s) : 0);
+		bn[0] = b[0] << s;
+		an[a.size()] = s ? a[a.size() - 1] >> (32 - s) : 0;
+		for (size_t i = a.size() - 1; i > 0; --i)
+			an[i] = (a[i] << s) | (s ? a[i - 1] >> (32 - s) : 0);
+		an[0] = a[0] << s;
+
+		q.assign(m + 1, 0);
+		for (size_t j = m + 1; j-- > 0;) {
+			uint64_t num = (static_cast<uint64_t>(an[j + n]) << 32) | an[j + n - 1];
+			uint64_t qhat = num / bn[n - 1];
+			uint64_t rhat = num % bn[n - 1];
+			while (qhat >> 32 || qhat * bn[n - 2] > ((rhat << 32) | an[j + n - 2])) {
+				--qhat;
+				rhat += bn[n - 1];
+				if (rhat >> 32) break;
+			}
+			int64_t borrow = 0;
+			uint64_t carry = 0;
+			for (size_t i = 0; i < n; ++i) {
+				uint64_t p = qhat * bn[i] + carry;
+				carry = p >> 32;
+				int64_t t = static_cast<int64_t>(an[i + j]) - borrow - static_cast<int64_t>(p & 0xffffffff);
+				an[i + j] = static_cast<uint32_t>(t);
+				borrow = t < 0 ? 1 : 0;
+			}
+			int64_t t = static_cast<int64_t>(an[j + n]) - borrow - static_cast<int64_t>(carry);
+			an[j + n] = static_cast<uint32_t>(t);
+			q[j] = static_cast<uint32_t>(qhat);
+			if (t < 0) {
+				--q[j];
+				uint64_t c = 0;
+				for (size_t i = 0; i < n; ++i) {
+					uint64_t u = static_cast<uint64_t>(an[i + j]) + bn[i] + c;
+					an[i + j] = static_cast<uint32_t>(u);
+					c = u >> 32;
+				}
+				an[j + n] += static_cast<uint32_t>(c);
+			}
+		}
+		r.resize(n);
+		for (size_t i = 0; i < n; ++i)
+			r[i] = (an[i] >> s) | (s ? an[i + 1] << (32 - s) : 0);
+	}
+
+public:
+	BigInt() {}
+
+	BigInt(int64_t v) {
+		negative = v < 0;
+		uint64_t m = negative ? static_cast<uint64_t>(-(v + 1)) + 1 : static_cast<uint64_t>(v);
+		while (m) {
+			mag.push_back(static_cast<uint32_t>(m));
+			m >>= 32;
+		}
+	}
+
+	static BigInt fromDouble(double d) {
+		BigInt r;
+		double m = std::trunc(std::fabs(d));
+		while (m >= 1) {
+			r.mag.push_back(static_cast<uint32_t>(std::fmod(m, 4294967296.0)));
+			m = std::floor(m / 4294967296.0);
+		}
+		r.negative = d < 0;
+		r.trim();
+		return r;
+	}
+
+	// Parses an optionally signed decimal string.
+	static bool parse(const std::string &s, BigInt &out) {
+		size_t i = 0;
+		bool neg = false;
+		if (i < s.size() && (s[i] == '-' || s[i] == '+'))
+			neg = s[i++] == '-';
+		if (i == s.size()) return false;
+		BigInt r;
+		for (; i < s.size(); ++i) {
+			if (s[i] < '0' || '9' < s[i]) return false;
+			uint64_t carry = s[i] - '0';
+			for (size_t k = 0; k < r.mag.size(); ++k) {
+				uint64_t t = static_cast<uint64_t>(r.mag[k]) * 10 + carry;
+				r.mag[k] = static_cast<uint32_t>(t);
+				carry = t >> 32;
+			}
+			if (carry) r.mag.push_back(static_cast<uint32_t>(carry));
+		}
+		r.negative = neg;
+		r.trim();
+		out = r;
+		return true;
+	}
+
+	bool isZero() const { return mag.empty(); }
+	bool isNegative() const { return negative; }
+
+	bool fitsInt64() const {
+		if (mag.size() > 2) return false;
+		uint64_t m = toMagnitude();
+		return negative ? m <= (static_cast<uint64_t>(1) << 63) : m < (static_cast<uint64_t>(1) << 63);
+	}
+
+	uint64_t toMagnitude() const {
+		uint64_t m = 0;
+		for (size_t i = std::min<size_t>(mag.size(), 2); i-- > 0;)
+			m = (m << 32) | mag[i];
+		return m;
+	}
+
+	int64_t toInt64() const {
+		uint64_t m = toMagnitude();
+		return negative ? static_cast<int64_t>(~m + 1) : static_cast<int64_t>(m);
+	}
+
+	double toDouble() const {
+		double d = 0;
+		for (size_t i = mag.size(); i-- > 0;)
+			d = d * 4294967296.0 + mag[i];
+		return negative ? -d : d;
+	}
+
+	std::string toString() const {
+		if (mag.empty()) return "0";
+		std::vector<uint32_t> m = mag;
+		std::string s;
+		while (!m.empty()) {
+			uint32_t chunk = divModSmall(m, 1000000000);
+			while (!m.empty() && m.back() == 0)
+				m.pop_back();
+			for (int i = 0; i < 9 && (chunk || !m.empty()); ++i) {
+				s.push_back('0' + chunk % 10);
+				chunk /= 10;
+			}
+		}
+		if (negative) s.push_back('-');
+		std::reverse(s.begin(), s.end());
+		return s;
+	}
+
+	size_t hash() const {
+		size_t h = negative;
+		for (uint32_t limb : mag)
+			h = h * 1000003 ^ limb;
+		return h;
+	}
+
+	size_t memoryUsage() const {
+		return mag.capacity() * sizeof(uint32_t);
+	}
+
+	static int compare(const BigInt &a, const BigInt &b) {
+		if (a.negative != b.negative)
+			return a.negative ? -1 : 1;
+		int c = compareMag(a.mag, b.mag);
+		return a.negative ? -c : c;
+	}
+
+	BigInt operator-() const {
+		BigInt r = *this;
+		if (!r.mag.empty()) r.negative = !negative;
+		return r;
+	}
+
+	friend BigInt operator+(const BigInt &a, const BigInt &b) {
+		BigInt r;
+		if (a.negative == b.negative) {
+			r.mag = addMag(a.mag, b.mag);
+			r.negative = a.negative;
+		} else if (compareMag(a.mag, b.mag) >= 0) {
+			r.mag = subMag(a.mag, b.mag);
+			r.negative = a.negative;
+		} else {
+			r.mag = subMag(b.mag, a.mag);
+			r.negative = b.negative;
+		}
+		r.trim();
+		return r;
+	}
+
+	friend BigInt operator-(const BigInt &a, const BigInt &b) {
+		return a + -b;
+	}
+
+	friend BigInt operator*(const BigInt &a, const BigInt &b) {
+		BigInt r;
+		r.mag = mulMag(a.mag, b.mag);
+		r.negative = a.negative != b.negative;
+		r.trim();
+		return r;
+	}
+
+	// Truncating division; the remainder takes the sign of the dividend.
+	static void divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r) {
+		BigInt quot, rem;
+		divModMag(a.mag, b.mag, quot.mag, rem.mag);
+		quot.negative = a.negative != b.negative;
+		rem.negative = a.negative;
+		quot.trim();
+		rem.trim();
+		q = quot;
+		r = rem;
+	}
+};
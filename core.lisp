@@ -74,14 +74,8 @@
            (cons (func (car xs)) (map-single func (cdr xs)))
            xs)))
 
-(def tree-eq?
-    (\ (obj-1 obj-2)
-       (if (eq? obj-1 obj-2)
-           t
-           (if (cons? obj-1)
-               (if (cons? obj-2)
-                   (if (tree-eq? (car obj-1) (car obj-2))
-                       (tree-eq? (cdr obj-1) (cdr obj-2))))))))
+; kept for compatibility; equal? is built in
+(def tree-eq? equal?)
 
 
 ;;; macros
@@ -211,6 +205,11 @@
                        (macro (unq lambda-list)
                               (unqs body))))))
 
+(defm defn-memo (name lambda-list . body)
+  (qquote (def (unq name)
+              (memoize (\ (unq lambda-list)
+                          (unqs body))))))
+
 (defm push! (value xs)
   (qquote (set! (unq xs) (cons (unq value) (unq xs)))))
 
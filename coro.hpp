@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && !defined(CORO_UCONTEXT)
+#define CORO_X86_64 1
+#else
+#include <ucontext.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+#ifdef CORO_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+// Stackful coroutines.
+// Each coroutine runs on its own mmap'd stack with a guard page below it;
+// the kernel commits pages only as the stack actually grows, so the
+// stacks are as large as a main thread's without costing memory up front. On x86-64 a
+// switch pushes the callee-saved registers and swaps stack pointers, a few
+// nanoseconds. Elsewhere it falls back to swapcontext, which also saves
+// the signal mask with a system call.
+
+namespace coro {
+
+#ifdef CORO_X86_64
+extern "C" void coro_switch(void **from, void *to);
+extern "C" void coro_start();
+
+// coro_start is entered by the first switch into a coroutine, with the
+// entry function in r13 and its argument in r12. Weak so that the header
+// can be included from more than one translation unit.
+__asm__(
+	".text\n"
+	".weak coro_switch\n"
+	".type coro_switch, @function\n"
+	"coro_switch:\n"
+	"\tpushq %rbp\n"
+	"\tpushq %rbx\n"
+	"\tpushq %r12\n"
+	"\tpushq %r13\n"
+	"\tpushq %r14\n"
+	"\tpushq %r15\n"
+	"\tmovq %rsp, (%rdi)\n"
+	"\tmovq %rsi, %rsp\n"
+	"\tpopq %r15\n"
+	"\tpopq %r14\n"
+	"\tpopq %r13\n"
+	"\tpopq %r12\n"
+	"\tpopq %rbx\n"
+	"\tpopq %rbp\n"
+	"\tret\n"
+	".size coro_switch, .-coro_switch\n"
+	".weak coro_start\n"
+	".type coro_start, @function\n"
+	"coro_start:\n"
+	"\tmovq %r12, %rdi\n"
+	"\tcallq *%r13\n"
+	"\tud2\n"
+	".size coro_start, .-coro_start\n");
+#endif
+
+// Recently freed stacks are kept per thread, so creating short-lived
+// coroutines in a loop does not mmap and munmap every time.
+class StackCache {
+	static const size_t capacity = 16;
+
+	std::vector<std::pair<void*, size_t> > stacks;
+
+public:
+	~StackCache() {
+		for (auto &s : stacks)
+			::munmap(s.first, s.second);
+	}
+
+	// Returns nullptr if the memory cannot be mapped.
+	void *allocate(size_t size) {
+		for (size_t i = 0; i < stacks.size(); ++i) {
+			if (stacks[i].second != size) continue;
+			void *p = stacks[i].first;
+			stacks[i] = stacks.back();
+			stacks.pop_back();
+			return p;
+		}
+		void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (p == MAP_FAILED) return nullptr;
+		::mprotect(p, ::sysconf(_SC_PAGESIZE), PROT_NONE);
+		return p;
+	}
+
+	void release(void *p, size_t size) {
+		if (stacks.size() < capacity)
+			stacks.emplace_back(p, size);
+		else
+			::munmap(p, size);
+	}
+
+	static StackCache &local() {
+		thread_local StackCache cache;
+		return cache;
+	}
+};
+
+class Coroutine {
+public:
+	typedef std::function<void()> Body;
+	static const size_t defaultStackSize = 8 << 20;
+	// Stack kept free below the point where stackExhausted() reports true,
+	// for the frames that throwing and unwinding an error need.
+	static const size_t stackReserve = 256 << 10;
+
+private:
+	Body body;
+	void *stack;
+	size_t stackSize;
+	uintptr_t stackLimit;
+	bool started = false;
+	bool finished = false;
+	bool running = false;
+	std::exception_ptr error;
+#ifdef CORO_X86_64
+	void *sp = nullptr;
+	void *callerSp = nullptr;
+#else
+	ucontext_t context;
+	ucontext_t callerContext;
+#endif
+#ifdef CORO_ASAN
+	// AddressSanitizer has to be told about every stack switch.
+	void *callerFakeStack = nullptr;
+	void *fakeStack = nullptr;
+	const void *callerStack = nullptr;
+	size_t callerStackSize = 0;
+#endif
+
+	static Coroutine *&currentRef() {
+		thread_local Coroutine *current = nullptr;
+		return current;
+	}
+
+	// Lowest address the running coroutine's frames may safely reach, or 0
+	// outside of any coroutine.
+	static uintptr_t &stackLimitRef() {
+		thread_local uintptr_t limit = 0;
+		return limit;
+	}
+
+	static void entry(Coroutine *self) {
+#ifdef CORO_ASAN
+		__sanitizer_finish_switch_fiber(nullptr, &self->callerStack, &self->callerStackSize);
+#endif
+		try {
+			self->body();
+		} catch (...) {
+			self->error = std::current_exception();
+		}
+		self->finished = true;
+		self->switchOut();
+	}
+
+#ifndef CORO_X86_64
+	static void trampoline(unsigned hi, unsigned lo) {
+		entry(reinterpret_cast<Coroutine*>((static_cast<uintptr_t>(hi) << 32) | lo));
+	}
+#endif
+
+	void prepare() {
+#ifdef CORO_X86_64
+		uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + stackSize) & ~static_cast<uintptr_t>(15);
+		void **frame = reinterpret_cast<void**>(top - 16);
+		// Return address, then rbp, rbx, r12, r13, r14, r15 as coro_switch pops them.
+		frame[1] = reinterpret_cast<void*>(&coro_start);
+		frame[0] = nullptr;
+		frame[-1] = nullptr;
+		frame[-2] = this;
+		frame[-3] = reinterpret_cast<void*>(&entry);
+		frame[-4] = nullptr;
+		frame[-5] = nullptr;
+		sp = frame - 5;
+#else
+		getcontext(&context);
+		context.uc_stack.ss_sp = stack;
+		context.uc_stack.ss_size = stackSize;
+		context.uc_link = nullptr;
+		uintptr_t p = reinterpret_cast<uintptr_t>(this);
+		makecontext(&context, reinterpret_cast<void(*)()>(&trampoline), 2,
+			static_cast<unsigned>(p >> 32), static_cast<unsigned>(p));
+#endif
+	}
+
+	void switchIn() {
+#ifdef CORO_ASAN
+		__sanitizer_start_switch_fiber(&callerFakeStack, stack, stackSize);
+#endif
+#ifdef CORO_X86_64
+		coro_switch(&callerSp, sp);
+#else
+		swapcontext(&callerContext, &context);
+#endif
+#ifdef CORO_ASAN
+		__sanitizer_finish_switch_fiber(callerFakeStack, nullptr, nullptr);
+#endif
+	}
+
+	void switchOut() {
+#ifdef CORO_ASAN
+		__sanitizer_start_switch_fiber(finished ? nullptr : &fakeStack, callerStack, callerStackSize);
+#endif
+#ifdef CORO_X86_64
+		coro_switch(&sp, callerSp);
+#else
+		swapcontext(&context, &callerContext);
+#endif
+#ifdef CORO_ASAN
+		__sanitizer_finish_switch_fiber(fakeStack, &callerStack, &callerStackSize);
+#endif
+	}
+
+public:
+	// Throws std::bad_alloc if the stack cannot be mapped.
+	explicit Coroutine(Body b, size_t size = defaultStackSize)
+	: body(std::move(b)), stackSize(size) {
+		stack = StackCache::local().allocate(stackSize);
+		if (stack == nullptr) throw std::bad_alloc();
+		stackLimit = reinterpret_cast<uintptr_t>(stack) + ::sysconf(_SC_PAGESIZE) + stackReserve;
+	}
+
+	// A coroutine suspended in the middle of its body still has live frames
+	// on its stack; the owner has to make it finish before destroying it.
+	~Coroutine() {
+		StackCache::local().release(stack, stackSize);
+	}
+
+	Coroutine(const Coroutine&) = delete;
+	Coroutine &operator=(const Coroutine&) = delete;
+
+	bool isStarted() const { return started; }
+	bool isFinished() const { return finished; }
+	bool isRunning() const { return running; }
+
+	// Runs the body until it yields or returns. An exception escaping the
+	// body is rethrown here. Must not be called on a finished or running
+	// coroutine.
+	void resume() {
+		if (!started) {
+			started = true;
+			prepare();
+		}
+		Coroutine *&current = currentRef();
+		Coroutine *resumer = current;
+		uintptr_t &limit = stackLimitRef();
+		uintptr_t resumerLimit = limit;
+		current = this;
+		limit = stackLimit;
+		running = true;
+		switchIn();
+		running = false;
+		current = resumer;
+		limit = resumerLimit;
+		if (finished) {
+			body = nullptr;
+			if (error) {
+				std::exception_ptr e = error;
+				error = nullptr;
+				std::rethrow_exception(e);
+			}
+		}
+	}
+
+	// Suspends the running coroutine and returns to its resumer.
+	void yield() {
+		switchOut();
+	}
+
+	// The coroutine running on this thread, or nullptr.
+	static Coroutine *current() {
+		return currentRef();
+	}
+
+	// True when the running coroutine is close to the end of its stack.
+	// Deep recursion should check this and fail with an error rather than
+	// run into the guard page. Always false outside of a coroutine.
+	static bool stackExhausted() {
+		char here;
+		return reinterpret_cast<uintptr_t>(&here) < stackLimitRef();
+	}
+};
+
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "coro.hpp"
+#include "port.hpp"
+
+// Single-threaded event loop for coroutine tasks.
+// A task that waits for a descriptor, a timer or another task suspends only
+// itself; the loop runs the other ready tasks and sleeps in epoll_wait when
+// there are none. Code that is not running directly in a task, such as the
+// REPL, waits by running the loop itself until its event arrives.
+// Descriptors are registered edge-triggered on their first wait and stay
+// registered until forget().
+
+class EventLoop {
+public:
+	class Task;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// Either a task to make ready, or a flag polled by code running the loop
+	// itself (task == nullptr).
+	struct Waiter {
+		EventLoop::Task *task;
+		bool ready;
+	};
+
+public:
+	class Task {
+		friend class EventLoop;
+		std::vector<Waiter*> joiners;
+
+	protected:
+		coro::Coroutine coroutine;
+
+		// Runs the task up to its next wait. Overridden to set up context
+		// that has to be in place while the task runs. Tasks report their
+		// own errors; anything escaping from here is dropped.
+		virtual void resume() {
+			coroutine.resume();
+		}
+
+	public:
+		explicit Task(coro::Coroutine::Body body)
+		: coroutine(std::move(body)) {}
+
+		virtual ~Task() {}
+
+		bool isFinished() const {
+			return coroutine.isFinished();
+		}
+	};
+
+	// Thrown out of a wait in a task that is cancelled by cancelAll.
+	struct Cancelled {};
+
+private:
+	struct Timer {
+		Clock::time_point deadline;
+		uint64_t seq;
+		Waiter *waiter;
+
+		bool operator>(const Timer &t) const {
+			return deadline != t.deadline ? deadline > t.deadline : seq > t.seq;
+		}
+	};
+
+	struct FdState {
+		std::vector<Waiter*> readers;
+		std::vector<Waiter*> writers;
+	};
+
+	int epfd;
+	int wakeFd;
+	std::function<void()> wakeHandler;
+	bool closing = false;
+	Task *running = nullptr;
+	uint64_t timerSeq = 0;
+	size_t fdWaiters = 0;
+	// Wakes of waiters that run the loop themselves, so that runOnce can
+	// return to them instead of sleeping.
+	uint64_t directWakes = 0;
+	std::unordered_map<Task*, std::shared_ptr<Task> > live;
+	std::deque<Task*> ready;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > timers;
+	std::unordered_map<int, FdState> fds;
+
+	// The task whose own coroutine is running, if any. Inside a generator
+	// called by a task this is nullptr: suspending the task's coroutine
+	// from there is not possible, so such code waits by running the loop.
+	Task *directTask() const {
+		if (running != nullptr && coro::Coroutine::current() == &running->coroutine)
+			return running;
+		return nullptr;
+	}
+
+	void wake(Waiter *w) {
+		w->ready = true;
+		if (w->task != nullptr)
+			ready.push_back(w->task);
+		else
+			++directWakes;
+	}
+
+	void wakeAll(std::vector<Waiter*> &waiters) {
+		for (Waiter *w : waiters)
+			wake(w);
+		fdWaiters -= waiters.size();
+		waiters.clear();
+	}
+
+	// Returns false if the loop is shutting down.
+	bool suspend(Waiter &w) {
+		if (closing) return false;
+		if (w.task != nullptr) {
+			w.task->coroutine.yield();
+		} else {
+			while (!w.ready && !closing) {
+				if (!runOnce() && !w.ready)
+					throw "deadlock: nothing left to wait for";
+			}
+		}
+		return !closing;
+	}
+
+	void resumeTask(Task *t) {
+		Task *saved = running;
+		running = t;
+		try {
+			t->resume();
+		} catch (...) {}
+		running = saved;
+		if (t->isFinished()) {
+			for (Waiter *w : t->joiners)
+				wake(w);
+			t->joiners.clear();
+			live.erase(t);
+		}
+	}
+
+	static int nonBlockingSocket(int family) {
+		return ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	}
+
+public:
+	// A TCP port on 127.0.0.1 or a Unix socket path.
+	struct Address {
+		sockaddr_storage storage;
+		socklen_t length;
+
+		static Address tcp(int port) {
+			Address a;
+			std::memset(&a.storage, 0, sizeof a.storage);
+			sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&a.storage);
+			in->sin_family = AF_INET;
+			in->sin_port = htons(static_cast<uint16_t>(port));
+			in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			a.length = sizeof(sockaddr_in);
+			return a;
+		}
+
+		// Returns false if the path is too long.
+		static bool local(const std::string &path, Address &a) {
+			std::memset(&a.storage, 0, sizeof a.storage);
+			sockaddr_un *un = reinterpret_cast<sockaddr_un*>(&a.storage);
+			if (path.size() >= sizeof un->sun_path) return false;
+			un->sun_family = AF_UNIX;
+			std::memcpy(un->sun_path, path.data(), path.size());
+			a.length = sizeof(sockaddr_un);
+			return true;
+		}
+
+		int family() const {
+			return storage.ss_family;
+		}
+	};
+
+	EventLoop()
+	: epfd(::epoll_create1(EPOLL_CLOEXEC)), wakeFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		ev.data.fd = wakeFd;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+	}
+
+	~EventLoop() {
+		cancelAll();
+		::close(wakeFd);
+		::close(epfd);
+	}
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop &operator=(const EventLoop&) = delete;
+
+	// Schedules a task. The loop keeps it alive until it finishes.
+	void spawn(const std::shared_ptr<Task> &t) {
+		live[t.get()] = t;
+		ready.push_back(t.get());
+	}
+
+	// Writing an 8-byte count to wakeupFd(), which a signal handler may do,
+	// makes the loop call the wakeup handler on its own thread, even while
+	// it sleeps in epoll_wait. The descriptor does not keep the loop running.
+	int wakeupFd() const {
+		return wakeFd;
+	}
+
+	void onWakeup(std::function<void()> handler) {
+		wakeHandler = std::move(handler);
+	}
+
+	size_t taskCount() const {
+		return live.size();
+	}
+
+	template <typename F>
+	void forEachTask(F f) const {
+		for (auto &kv : live)
+			f(kv.first);
+	}
+
+	bool inTask() const {
+		return running != nullptr;
+	}
+
+	// Runs the tasks that are ready, then waits for one batch of events.
+	// Returns false if there is nothing left to wait for.
+	bool runOnce() {
+		uint64_t wakes = directWakes;
+		for (size_t n = ready.size(); n > 0 && !ready.empty(); --n) {
+			Task *t = ready.front();
+			ready.pop_front();
+			resumeTask(t);
+		}
+		if (!ready.empty() || directWakes != wakes) return true;
+		if (fdWaiters == 0 && timers.empty()) return false;
+
+		int timeout = -1;
+		if (!timers.empty()) {
+			auto wait = timers.top().deadline - Clock::now();
+			timeout = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+				wait + std::chrono::milliseconds(1) - Clock::duration(1)).count());
+		}
+		epoll_event events[256];
+		int n = ::epoll_wait(epfd, events, 256, timeout);
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == wakeFd) {
+				uint64_t count;
+				if (::read(wakeFd, &count, sizeof count) > 0 && wakeHandler)
+					wakeHandler();
+				continue;
+			}
+			auto it = fds.find(events[i].data.fd);
+			if (it == fds.end()) continue;
+			uint32_t e = events[i].events;
+			if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				wakeAll(it->second.readers);
+			if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				wakeAll(it->second.writers);
+		}
+		Clock::time_point now = Clock::now();
+		while (!timers.empty() && timers.top().deadline <= now) {
+			wake(timers.top().waiter);
+			timers.pop();
+		}
+		return true;
+	}
+
+	// Runs until every task has finished or none of them can go on.
+	void run() {
+		while (!live.empty() && runOnce());
+	}
+
+	// Makes every unfinished task's pending wait fail so that its frames
+	// are unwound. The loop cannot be used afterwards.
+	void cancelAll() {
+		closing = true;
+		ready.clear();
+		while (!live.empty()) {
+			Task *t = live.begin()->first;
+			if (!t->coroutine.isStarted() || t->coroutine.isRunning())
+				live.erase(live.begin());
+			else
+				resumeTask(t);
+		}
+	}
+
+	// Waits until the descriptor may be ready. Returns at once if it cannot
+	// be polled, like a regular file, and false if the loop is shutting down.
+	bool waitFd(int fd, bool output) {
+		if (closing) return false;
+		auto it = fds.find(fd);
+		if (it == fds.end()) {
+			epoll_event ev;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.u64 = 0;
+			ev.data.fd = fd;
+			if (::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+				return true;
+			it = fds.emplace(fd, FdState()).first;
+		}
+		Waiter w = {directTask(), false};
+		std::vector<Waiter*> &waiters = output ? it->second.writers : it->second.readers;
+		waiters.push_back(&w);
+		++fdWaiters;
+		bool ok = suspend(w);
+		if (!w.ready) {
+			auto p = fds.find(fd);
+			if (p != fds.end()) {
+				std::vector<Waiter*> &v = output ? p->second.writers : p->second.readers;
+				v.erase(std::remove(v.begin(), v.end(), &w), v.end());
+				--fdWaiters;
+			}
+		}
+		return ok;
+	}
+
+	// Drops a descriptor that is about to be closed, waking its waiters.
+	void forget(int fd) {
+		auto it = fds.find(fd);
+		if (it == fds.end()) return;
+		wakeAll(it->second.readers);
+		wakeAll(it->second.writers);
+		::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+		fds.erase(it);
+	}
+
+	void sleep(int64_t ms) {
+		Waiter w = {directTask(), false};
+		timers.push(Timer{Clock::now() + std::chrono::milliseconds(ms), timerSeq++, &w});
+		if (!suspend(w)) throw Cancelled();
+	}
+
+	// Waits for a task to finish.
+	void join(Task &t) {
+		if (t.isFinished()) return;
+		if (&t == running && directTask() == running)
+			throw "a task cannot join itself";
+		Waiter w = {directTask(), false};
+		t.joiners.push_back(&w);
+		if (!suspend(w)) throw Cancelled();
+	}
+
+	// Returns a non-blocking listening socket, or -1.
+	int listen(const Address &a) {
+		int fd = nonBlockingSocket(a.family());
+		if (fd < 0) return -1;
+		int one = 1;
+		if (a.family() == AF_INET)
+			::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		else
+			::unlink(reinterpret_cast<const sockaddr_un*>(&a.storage)->sun_path);
+		if (::bind(fd, reinterpret_cast<const sockaddr*>(&a.storage), a.length) < 0 ||
+			::listen(fd, SOMAXCONN) < 0) {
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// Waits for a connection and returns a non-blocking socket, or -1.
+	int accept(int listener) {
+		for (;;) {
+			int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd >= 0) {
+				int one = 1;
+				::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+				return fd;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+			if (!waitFd(listener, false)) throw Cancelled();
+		}
+	}
+
+	// Returns a connected non-blocking socket, or -1.
+	int connect(const Address &a) {
+		int fd = nonBlockingSocket(a.family());
+		if (fd < 0) return -1;
+		if (::connect(fd, reinterpret_cast<const sockaddr*>(&a.storage), a.length) < 0) {
+			if (errno != EINPROGRESS && errno != EAGAIN) {
+				::close(fd);
+				return -1;
+			}
+			if (!waitFd(fd, true)) {
+				forget(fd);
+				::close(fd);
+				throw Cancelled();
+			}
+			int error = 0;
+			socklen_t length = sizeof error;
+			::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error != 0) {
+				forget(fd);
+				::close(fd);
+				return -1;
+			}
+		}
+		if (a.family() == AF_INET) {
+			int one = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		}
+		return fd;
+	}
+};
+
+// FdStreamBuf whose waits suspend the current task instead of the thread.
+// A blocking descriptor such as an inherited standard input is polled for
+// readiness before every read, since reading it cannot return EAGAIN.
+class AsyncStreamBuf : public FdStreamBuf {
+	EventLoop &loop;
+	bool blocking;
+
+protected:
+	bool waitReady(bool output) {
+		return loop.waitFd(descriptor(), output);
+	}
+
+	ssize_t readSome(char *p, size_t n) {
+		if (blocking) {
+			pollfd pfd = {descriptor(), POLLIN, 0};
+			if (::poll(&pfd, 1, 0) == 0 && !loop.waitFd(descriptor(), false))
+				return 0;
+		}
+		return FdStreamBuf::readSome(p, n);
+	}
+
+public:
+	AsyncStreamBuf(EventLoop &l, int fd, bool owned = true, bool b = false)
+	: FdStreamBuf(fd, owned), loop(l), blocking(b) {}
+
+	~AsyncStreamBuf() {
+		sync();
+		loop.forget(descriptor());
+	}
+};
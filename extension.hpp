@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lisp.hpp"
+
+// Native extension interface.
+// An extension is a shared object loaded with (load-extension "libfoo.so").
+// It exports lisp_extension_init, which receives the table below and
+// registers its builtins through it. Builtins take and return LobjSPtr
+// directly, so a call costs the same as a call to a built-in function.
+// Objects are created through the table so that they come from the
+// interpreter's allocator.
+//
+// The table is only ever extended at the end: `version` goes up with each
+// addition and an extension should refuse a table older than the one it
+// was built against. Since LobjSPtr and BuiltinFunction are C++ types, an
+// extension has to be built with the same compiler and standard library as
+// the interpreter.
+//
+//   g++ -std=c++11 -O2 -fPIC -shared -o libfoo.so foo.cpp
+
+#define LISP_EXTENSION_API_VERSION 1
+
+struct LispExtensionApi {
+	uint32_t version;
+
+	// The table outlives the extension's initialization and may be kept.
+	// Functions that need an interpreter use the one the calling thread is
+	// running; builtins are always called with it set.
+
+	// Binds `name` globally. The call fails with the usual "bad arguments"
+	// error unless it has between minArgs and maxArgs arguments; maxArgs -1
+	// means no upper bound.
+	void (*defineBuiltin)(const char *name, int minArgs, int maxArgs, BuiltinFunction function);
+
+	LobjSPtr (*intern)(const char *name);
+	LobjSPtr (*makeInt)(int64_t value);
+	LobjSPtr (*makeString)(const char *data, size_t length);
+	LobjSPtr (*makeCons)(const LobjSPtr &car, const LobjSPtr &cdr);
+
+	// Return false if the object is not of the requested type. toString
+	// points into the string object, which must outlive the view.
+	bool (*toInt64)(const LobjSPtr &obj, int64_t &value);
+	bool (*toString)(const LobjSPtr &obj, const char *&data, size_t &length);
+	bool (*toCons)(const LobjSPtr &obj, LobjSPtr &car, LobjSPtr &cdr);
+	bool (*isNil)(const LobjSPtr &obj);
+
+	// Calls a procedure or builtin from native code.
+	LobjSPtr (*apply)(Env &env, const LobjSPtr &function, std::vector<LobjSPtr> &args);
+};
+
+// Returns 0 on success. Anything else makes load-extension fail.
+typedef int (*LispExtensionInit)(const LispExtensionApi *api);
+
+#define LISP_EXTENSION_INIT_SYMBOL "lisp_extension_init"
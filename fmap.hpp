@@ -65,6 +65,8 @@ public:
 			return it->second;
 	}
 
+	size_t size() const { return entries.size(); }
+
 	iterator begin() { return entries.begin(); }
 	iterator end() { return entries.end(); }
 	const_iterator begin() const { return entries.begin(); }
@@ -7,11 +7,45 @@
 #include <stdint.h>
 #include <fstream>
 #include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <iomanip>
+#include <functional>
+#include <csignal>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <unordered_map>
 #include "fmap.hpp"
+#include "bignum.hpp"
+#include "simd.hpp"
+#include "ohash.hpp"
+#include "persistent.hpp"
+#include "port.hpp"
+#include "trace.hpp"
+#include "threadpool.hpp"
+#include "coro.hpp"
+#include "eventloop.hpp"
+#include "lisp.hpp"
+#include "extension.hpp"
 
 #define TCO true
 
-class Env;
+// Receives the references of an object while the heap is dumped. Null
+// pointers are ignored.
+struct HeapWalker {
+	virtual void ref(const Lobj *obj) = 0;
+	virtual void ref(const Env *env) = 0;
+	// Storage shared by several objects that refers to nothing, such as the
+	// buffer behind a string and its substrings.
+	virtual void ref(const void *block, const char *type, size_t size) = 0;
+
+	void ref(const LobjSPtr &obj) { ref(obj.get()); }
+	void ref(const EnvSPtr &env) { ref(env.get()); }
+};
 
 struct Lobj {
 	virtual ~Lobj() {}
@@ -29,50 +63,519 @@ struct Lobj {
 	virtual void print(std::ostream &os) const = 0;
 	virtual bool eq(Lobj *obj) const;
 	bool isNil() const;
+
+	// For heap-dump: the bytes the object owns, approximately, and the
+	// objects it refers to.
+	virtual size_t size() const = 0;
+	virtual void forEachRef(HeapWalker &walker) {}
+};
+
+// What is left of the limits of the innermost with-limits on this thread.
+// The step counter is all the evaluator looks at; the clock is read every
+// clockInterval steps.
+struct Budget {
+	static const uint64_t unlimited = UINT64_MAX / 2;
+	static const uint64_t clockInterval = 1024;
+
+	uint64_t steps = 0;
+	uint64_t maxSteps = unlimited;
+	uint64_t bytes = 0;
+	uint64_t maxBytes = unlimited;
+	bool timed = false;
+	std::chrono::steady_clock::time_point deadline;
+	uint64_t nextCheck = 0;
+
+	void step() {
+		if (++steps >= nextCheck)
+			check();
+	}
+
+	void charge(size_t n) {
+		if (n > maxBytes - std::min(bytes, maxBytes))
+			throw LimitExceeded{"memory limit exceeded"};
+		bytes += n;
+	}
+
+	void check() {
+		if (steps > maxSteps)
+			throw LimitExceeded{"step limit exceeded"};
+		nextCheck = maxSteps + 1;
+		if (timed) {
+			if (std::chrono::steady_clock::now() >= deadline)
+				throw LimitExceeded{"time limit exceeded"};
+			nextCheck = std::min(nextCheck, steps + clockInterval);
+		}
+	}
 };
 
-typedef std::shared_ptr<Lobj> LobjSPtr;
-typedef std::weak_ptr<Lobj>   LobjWPtr;
-typedef std::shared_ptr<Env> EnvSPtr;
-typedef std::weak_ptr<Env>   EnvWPtr;
+const uint64_t Budget::unlimited;
+const uint64_t Budget::clockInterval;
+
+// Null unless a with-limits is in effect.
+thread_local Budget *currentBudget = nullptr;
+
+void chargeBytes(size_t n) {
+	if (currentBudget != nullptr)
+		currentBudget->charge(n);
+}
+
+// Charges for n elements of the given size and returns n, so that a
+// constructor can charge in its member-init list, before it allocates.
+size_t chargeElements(size_t n, size_t elementSize) {
+	chargeBytes(n <= SIZE_MAX / elementSize ? n * elementSize : SIZE_MAX);
+	return n;
+}
+
+// Counts an evaluation step, or a loop iteration, against the budget.
+void chargeStep() {
+	if (currentBudget != nullptr)
+		currentBudget->step();
+}
+
+// Objects are created through here so that with-limits can count them.
+// Constructors charge for the storage they allocate besides the object.
+template<typename T, typename... Args>
+std::shared_ptr<T> newObj(Args&&... args) {
+	chargeBytes(sizeof(T));
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
 
+// A cons is either allocated on its own or is one cell of a ConsBlock.
+// Inside a block, a null `next` means the cdr is the following cell: the
+// list is CDR-coded, and walking it reads consecutive memory. Setting the
+// cdr stores it explicitly, so the cell then works like any other cons.
 struct Cons : public Lobj {
 	LobjSPtr car;
-	LobjSPtr cdr;
 
 	Cons(LobjSPtr a, LobjSPtr d)
-	: car(a), cdr(d) {}
+	: car(a), next(d) {}
+
+	// Valid as long as this cons is; use cdrOf for a pointer to keep.
+	Lobj *cdrPtr() const {
+		return next != nullptr ? next.get() : const_cast<Cons*>(this + 1);
+	}
+
+	void setCdr(LobjSPtr d) {
+		next = d;
+	}
 
 	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(car);
+		walker.ref(cdrPtr());
+	}
+
+private:
+	friend LobjSPtr cdrOf(const LobjSPtr &cons);
+	friend struct ConsBlock;
+
+	LobjSPtr next;
+};
+
+// The cdr of a cons. A cell of a block shares ownership of the whole block,
+// so the following cell is returned aliasing the pointer to this one.
+inline LobjSPtr cdrOf(const LobjSPtr &cons) {
+	Cons &c = cons->getAs<Cons>();
+	if (c.next != nullptr)
+		return c.next;
+	return LobjSPtr(cons, &c + 1);
+}
+
+// The cells of a list allocated together: one allocation, and one reference
+// count, for the whole run rather than two per element.
+struct ConsBlock {
+	std::vector<Cons> cells;
+
+	// `tail` is the cdr of the last cell.
+	static LobjSPtr make(const std::vector<LobjSPtr> &elements, LobjSPtr tail) {
+		size_t n = elements.size();
+		chargeBytes(sizeof(ConsBlock) + n * sizeof(Cons));
+		std::shared_ptr<ConsBlock> block = std::make_shared<ConsBlock>();
+		block->cells.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+			block->cells.emplace_back(elements[i], i + 1 < n ? nullptr : std::move(tail));
+		return LobjSPtr(block, &block->cells[0]);
+	}
 };
 
+// Lists of two or more elements are built as a ConsBlock.
+LobjSPtr makeList(const std::vector<LobjSPtr> &elements, LobjSPtr tail) {
+	if (elements.empty())
+		return tail;
+	if (elements.size() == 1)
+		return newObj<Cons>(elements[0], std::move(tail));
+	return ConsBlock::make(elements, std::move(tail));
+}
+
 struct Symbol : public Lobj {
 	const std::string name;
+	// Value in the root environment. Keeping it here rather than in a map
+	// lets a new global be defined while pool threads are reading others.
+	LobjSPtr globalValue;
+	// Set once a REPL session defines the symbol, so that its session
+	// binding is looked up dynamically like a global one.
+	bool sessionDefined = false;
 
-	Symbol(const std::string n)
-	: name(n) {}
+	Symbol(std::string n)
+	: name(std::move(n)) {}
 
 	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + name.size(); }
+	void forEachRef(HeapWalker &walker) { walker.ref(globalValue); }
 };
 
 struct Int : public Lobj {
-	int value;
+	int64_t value;
+
+	Int (int64_t v)
+	: value(v) {}
+
+	void print(std::ostream &os) const;
+	bool eq(Lobj *obj) const;
+	size_t size() const { return sizeof(*this); }
+};
+
+// Ints are shared freely, so they are never changed once another reference
+// exists; dotimes is the only place that updates one in place.
+const int64_t smallIntMin = -128;
+const int64_t smallIntMax = 1023;
+
+// Ints in the small range come from a per-thread table and allocate
+// nothing. The table is per thread so that pool threads doing arithmetic do
+// not contend on the reference counts of the same few objects.
+LobjSPtr makeInt(int64_t value) {
+	if (value < smallIntMin || smallIntMax < value)
+		return newObj<Int>(value);
+	thread_local std::vector<LobjSPtr> cache;
+	if (cache.empty()) {
+		cache.reserve(smallIntMax - smallIntMin + 1);
+		for (int64_t i = smallIntMin; i <= smallIntMax; ++i)
+			cache.push_back(std::make_shared<Int>(i));
+	}
+	return cache[value - smallIntMin];
+}
+
+struct Bignum : public Lobj {
+	BigInt value;
+
+	Bignum (const BigInt &v)
+	: value(v) {}
+
+	void print(std::ostream &os) const;
+	bool eq(Lobj *obj) const;
+	size_t size() const { return sizeof(*this) + value.memoryUsage(); }
+};
+
+struct Float : public Lobj {
+	double value;
 
-	Int (int v)
+	Float (double v)
 	: value(v) {}
 
 	void print(std::ostream &os) const;
 	bool eq(Lobj *obj) const;
+	size_t size() const { return sizeof(*this); }
 };
 
+// Immutable string. A substring is a view sharing the buffer of the string
+// it was taken from, so slicing never copies characters.
 struct String : public Lobj {
-	std::string value;
+	std::shared_ptr<const std::string> buffer;
+	size_t offset;
+	size_t length;
 
 	String (const std::string &v)
-	: value(v) {}
+	: offset(0), length(v.size()) {
+		chargeBytes(length);
+		buffer = std::make_shared<std::string>(v);
+	}
+
+	String (std::string &&v)
+	: offset(0), length(v.size()) {
+		chargeBytes(length);
+		buffer = std::make_shared<std::string>(std::move(v));
+	}
+
+	String (const std::shared_ptr<const std::string> &b, size_t o, size_t l)
+	: buffer(b), offset(o), length(l) {}
+
+	const char *data() const { return buffer->data() + offset; }
+	std::string str() const { return std::string(data(), length); }
 
 	void print(std::ostream &os) const;
 	bool eq(Lobj *obj) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(buffer.get(), "StringBuffer", sizeof(std::string) + buffer->capacity());
+	}
+};
+
+struct StringBuilder : public Lobj {
+	std::string value;
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + value.capacity(); }
+};
+
+// Stream buffer appending to a std::string, for printing objects into a
+// string without an intermediate stringstream.
+class StringSink : public std::streambuf {
+	std::string &out;
+
+protected:
+	int_type overflow(int_type c) {
+		if (c != traits_type::eof())
+			out.push_back(static_cast<char>(c));
+		return c;
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n) {
+		out.append(s, n);
+		return n;
+	}
+
+public:
+	StringSink (std::string &o)
+	: out(o) {}
+};
+
+// Stream buffer reading straight out of a String's shared buffer.
+class StringSource : public std::streambuf {
+	std::shared_ptr<const std::string> buffer;
+
+public:
+	StringSource (const std::shared_ptr<const std::string> &b, size_t offset, size_t length)
+	: buffer(b) {
+		char *p = const_cast<char*>(b->data()) + offset;
+		setg(p, p, p + length);
+	}
+};
+
+// Created by the delay special form. The expression is evaluated by the
+// first force and the value is remembered.
+struct Promise : public Lobj {
+	LobjSPtr expr;
+	EnvSPtr env;
+	LobjSPtr value;
+
+	Promise (LobjSPtr x, EnvSPtr e)
+	: expr(x), env(e) {}
+
+	LobjSPtr force();
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(expr);
+		walker.ref(env);
+		walker.ref(value);
+	}
+};
+
+// A sequence cell computed on demand. Forcing runs the producer once and
+// remembers its result, which is nil or a Cons of the head and the rest.
+struct LazySeq : public Lobj {
+	std::function<LobjSPtr()> producer;
+	LobjSPtr cell;
+
+	LazySeq (const std::function<LobjSPtr()> &p)
+	: producer(p) {}
+
+	LobjSPtr force() {
+		if (producer) {
+			cell = producer();
+			producer = nullptr;
+		}
+		return cell;
+	}
+
+	void print(std::ostream &os) const;
+	// What the producer holds on to is not visible.
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) { walker.ref(cell); }
+};
+
+// Result of the future special form. The expression is evaluated on the
+// shared thread pool; touch waits for it.
+struct Future : public Lobj {
+	std::atomic<bool> done;
+	LobjSPtr value;
+	std::exception_ptr error;
+
+	Future ()
+	: done(false) {}
+
+	LobjSPtr touch();
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		if (done.load())
+			walker.ref(value);
+	}
+};
+
+// Futures submitted and not yet done, in every interpreter. While there are
+// none, no other thread can be looking at this thread's objects.
+std::atomic<size_t> futuresRunning(0);
+
+// Created by make-generator. The thunk runs on a coroutine of its own, so
+// yield can suspend it at any depth of evaluation; environments are shared
+// with the creator, not copied.
+struct Generator : public Lobj {
+	LobjSPtr thunk;
+	EnvSPtr env;
+	coro::Coroutine coroutine;
+	// Value passed by yield to resume, or by resume to yield.
+	LobjSPtr transfer;
+	bool cancelled = false;
+	// The budget of whoever resumed the generator, and the generator's own
+	// with-limits budget while it is suspended inside one.
+	Budget *resumerBudget = nullptr;
+	Budget *ownBudget = nullptr;
+
+	Generator (LobjSPtr thunk, EnvSPtr env);
+	~Generator();
+
+	bool resume(LobjSPtr &value);
+	LobjSPtr yield(LobjSPtr value);
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(thunk);
+		walker.ref(env);
+		walker.ref(transfer);
+	}
+};
+
+// Created by spawn. Runs a function as a task of the interpreter's event
+// loop; a wait for I/O, a timer or another task suspends only this task.
+struct Task : public Lobj, public EventLoop::Task {
+	Interpreter *interpreter;
+	LobjSPtr thunk;
+	EnvSPtr env;
+	// Session environment and standard ports of the task, inherited from
+	// the spawner. They are swapped into the interpreter while it runs.
+	EnvSPtr session;
+	LobjSPtr input;
+	LobjSPtr output;
+	LobjSPtr value;
+	// Innermost with-limits of the task while it is suspended. Tasks do not
+	// run under the budget of the code that spawned them.
+	Budget *budget = nullptr;
+
+	Task (LobjSPtr thunk, EnvSPtr env);
+
+	void resume();
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(thunk);
+		walker.ref(env);
+		walker.ref(session);
+		walker.ref(input);
+		walker.ref(output);
+		walker.ref(value);
+	}
+};
+
+// An error as seen by handler-case. The kind is `error`, or
+// `limit-exceeded` for an evaluation stopped by with-limits.
+struct Condition : public Lobj {
+	LobjSPtr kind;
+	std::string message;
+	LobjSPtr irritants;
+
+	Condition (LobjSPtr k, const std::string &m, LobjSPtr i)
+	: kind(k), message(m), irritants(i) {}
+
+	// The message followed by the irritants, as the REPL reports it.
+	void report(std::ostream &os) const;
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + message.size(); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(kind);
+		walker.ref(irritants);
+	}
+};
+
+struct InputPort : public Lobj {
+	std::shared_ptr<std::streambuf> buf;
+	std::istream stream;
+
+	InputPort (const std::shared_ptr<std::streambuf> &b)
+	: buf(b), stream(b.get()) {}
+
+	void close() {
+		stream.rdbuf(nullptr);
+		buf.reset();
+	}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+};
+
+// A connected socket, usable both as an input and as an output port.
+// Pending output is flushed before every read.
+struct Socket : public Lobj {
+	std::shared_ptr<std::streambuf> buf;
+	std::istream in;
+	std::ostream out;
+
+	Socket (const std::shared_ptr<std::streambuf> &b)
+	: buf(b), in(b.get()), out(b.get()) {
+		in.tie(&out);
+	}
+
+	void close() {
+		if (buf == nullptr) return;
+		out.flush();
+		in.rdbuf(nullptr);
+		out.rdbuf(nullptr);
+		buf.reset();
+	}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+};
+
+struct Listener : public Lobj {
+	EventLoop &loop;
+	int fd;
+
+	Listener (EventLoop &l, int f)
+	: loop(l), fd(f) {}
+
+	~Listener () {
+		close();
+	}
+
+	void close() {
+		if (fd < 0) return;
+		loop.forget(fd);
+		::close(fd);
+		fd = -1;
+	}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+};
+
+struct OutputPort : public Lobj {
+	std::shared_ptr<std::streambuf> buf;
+	std::ostream stream;
+
+	OutputPort (const std::shared_ptr<std::streambuf> &b)
+	: buf(b), stream(b.get()) {}
+
+	void close() {
+		if (buf == nullptr) return;
+		stream.flush();
+		stream.rdbuf(nullptr);
+		buf.reset();
+	}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
 };
 
 struct Proc : public Lobj {
@@ -84,15 +587,37 @@ struct Proc : public Lobj {
 	: parameterList(pl), body(b), env(e) {}
 
 	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(parameterList);
+		walker.ref(body);
+		walker.ref(env);
+	}
 };
 
 struct BuiltinProc : public Lobj {
-	std::function<LobjSPtr(Env &env, std::vector<LobjSPtr> &)> function;
-
-	BuiltinProc (std::function<LobjSPtr(Env &env, std::vector<LobjSPtr> &)> f)
-	: function(f) {}
+	BuiltinFunction function;
+	// Checked before the call; the built-in functions defined here check
+	// their own arguments and accept any count.
+	size_t minArgs;
+	size_t maxArgs;
+	std::string error;
+
+	BuiltinProc (BuiltinFunction f)
+	: function(f), minArgs(0), maxArgs(SIZE_MAX) {}
+
+	BuiltinProc (BuiltinFunction f, const std::string &name, int min, int max)
+	: function(f), minArgs(min < 0 ? 0 : min), maxArgs(max < 0 ? SIZE_MAX : max),
+		error("bad arguments for function '" + name + "'") {}
+
+	LobjSPtr call(Env &env, std::vector<LobjSPtr> &args) {
+		if (args.size() < minArgs || args.size() > maxArgs)
+			throw error.c_str();
+		return function(env, args);
+	}
 
 	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + error.size(); }
 };
 
 struct Macro : public Lobj {
@@ -104,19 +629,181 @@ struct Macro : public Lobj {
 	: parameterList(pl), body(b), env(e) {}
 
 	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this); }
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(parameterList);
+		walker.ref(body);
+		walker.ref(env);
+	}
+};
+
+struct Vector : public Lobj {
+	std::vector<LobjSPtr> elements;
+
+	Vector (size_t n, LobjSPtr fill)
+	: elements(chargeElements(n, sizeof(LobjSPtr)), fill) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + elements.capacity() * sizeof(LobjSPtr); }
+	void forEachRef(HeapWalker &walker) {
+		for (LobjSPtr &x : elements)
+			walker.ref(x);
+	}
+};
+
+struct IntVector : public Lobj {
+	std::vector<int64_t> elements;
+
+	IntVector (size_t n, int64_t fill = 0)
+	: elements(chargeElements(n, sizeof(int64_t)), fill) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + elements.capacity() * sizeof(int64_t); }
+};
+
+struct ByteVector : public Lobj {
+	std::vector<uint8_t> elements;
+
+	ByteVector (size_t n, uint8_t fill = 0)
+	: elements(chargeElements(n, 1), fill) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + elements.capacity(); }
+};
+
+// Hashing and equality for hash tables: `eq?` semantics, or `equal?` when structural.
+struct LobjHash {
+	bool structural;
+	size_t operator()(const LobjSPtr &obj) const;
+};
+
+struct LobjEqual {
+	bool structural;
+	bool operator()(const LobjSPtr &a, const LobjSPtr &b) const;
+};
+
+struct HashTable : public Lobj {
+	bool structural;
+	OpenHashMap<LobjSPtr, LobjSPtr, LobjHash, LobjEqual> map;
+
+	HashTable (bool s)
+	: structural(s), map(LobjHash{s}, LobjEqual{s}) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const { return sizeof(*this) + map.memoryUsage(); }
+	void forEachRef(HeapWalker &walker) {
+		map.forEach([&walker](const LobjSPtr &key, const LobjSPtr &value) {
+				walker.ref(key);
+				walker.ref(value);
+			});
+	}
+};
+
+// Argument lists as keys of a memo cache, compared element by element with `equal?`.
+struct ArgsHash {
+	size_t operator()(const std::vector<LobjSPtr> &args) const;
+};
+
+struct ArgsEqual {
+	bool operator()(const std::vector<LobjSPtr> &a, const std::vector<LobjSPtr> &b) const;
+};
+
+// A procedure that remembers its results by argument list. Once the cache
+// holds `capacity` results, each new one replaces an entry chosen by the
+// clock algorithm: the hand clears the mark of entries hit since it last
+// passed them and evicts the first unmarked one. The lock is not held while
+// the procedure runs, so recursive calls and pool threads can use the cache.
+struct MemoProc : public Lobj {
+	struct Entry {
+		std::vector<LobjSPtr> args;
+		LobjSPtr value;
+		bool referenced;
+	};
+
+	LobjSPtr function;
+	size_t capacity;
+	std::vector<Entry> entries;
+	OpenHashMap<std::vector<LobjSPtr>, size_t, ArgsHash, ArgsEqual> index;
+	size_t hand = 0;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	std::mutex mutex;
+
+	MemoProc (LobjSPtr f, size_t c)
+	: function(f), capacity(c) {}
+
+	LobjSPtr call(Env &env, std::vector<LobjSPtr> &args);
+	void clear();
+	void print(std::ostream &os) const;
+	size_t size() const;
+	void forEachRef(HeapWalker &walker);
+};
+
+typedef PersistentVector<LobjSPtr> LobjPVector;
+typedef HashTrieMap<LobjSPtr, LobjSPtr, LobjHash, LobjEqual> LobjPMap;
+
+// Persistent collections are values: eq? and hashing look at their contents.
+struct PVector : public Lobj {
+	LobjPVector value;
+	mutable size_t hashCache = 0;
+
+	PVector (const LobjPVector &v)
+	: value(v) {}
+
+	void print(std::ostream &os) const;
+	bool eq(Lobj *obj) const;
+	size_t size() const;
+	void forEachRef(HeapWalker &walker);
+};
+
+struct PMap : public Lobj {
+	LobjPMap value;
+	mutable size_t hashCache = 0;
+
+	PMap (const LobjPMap &v)
+	: value(v) {}
+
+	void print(std::ostream &os) const;
+	bool eq(Lobj *obj) const;
+	size_t size() const;
+	void forEachRef(HeapWalker &walker);
+};
+
+struct TransientVector : public Lobj {
+	LobjPVector value;
+	bool sealed = false;
+
+	TransientVector (const LobjPVector &v)
+	: value(v.transient()) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const;
+	void forEachRef(HeapWalker &walker);
+};
+
+struct TransientMap : public Lobj {
+	LobjPMap value;
+	bool sealed = false;
+
+	TransientMap (const LobjPMap &v)
+	: value(v.transient()) {}
+
+	void print(std::ostream &os) const;
+	size_t size() const;
+	void forEachRef(HeapWalker &walker);
 };
 
 
 void Cons::print(std::ostream &os) const {
 	os << "(";
 	car->print(os);
-	Lobj *o = this->cdr.get();
+	Lobj *o = cdrPtr();
 	while (1) {
 		if (o->typep<Cons>()) {
 			os << " ";
 			Cons *cons = &o->getAs<Cons>();
 			cons->car->print(os);
-			o = cons->cdr.get();
+			o = cons->cdrPtr();
 		} else if (o->isNil()) {
 			break;
 		} else {
@@ -136,8 +823,89 @@ void Int::print(std::ostream &os) const {
 	os << value;
 }
 
+void Bignum::print(std::ostream &os) const {
+	os << value.toString();
+}
+
+void Float::print(std::ostream &os) const {
+	if (std::isnan(value)) {
+		os << "nan";
+		return;
+	}
+	if (std::isinf(value)) {
+		os << (value < 0 ? "-inf" : "inf");
+		return;
+	}
+	std::string str;
+	for (int precision = 15; precision <= 17; ++precision) {
+		std::ostringstream ss;
+		ss << std::setprecision(precision) << value;
+		str = ss.str();
+		if (std::strtod(str.c_str(), nullptr) == value) break;
+	}
+	if (str.find_first_of(".e") == std::string::npos)
+		str += ".0";
+	os << str;
+}
+
 void String::print(std::ostream &os) const {
-	os << value;
+	os.write(data(), length);
+}
+
+void StringBuilder::print(std::ostream &os) const {
+	os << "#StringBuilder";
+}
+
+void Promise::print(std::ostream &os) const {
+	os << "#Promise";
+}
+
+void LazySeq::print(std::ostream &os) const {
+	os << "#LazySeq";
+}
+
+void Future::print(std::ostream &os) const {
+	os << "#Future";
+}
+
+void Generator::print(std::ostream &os) const {
+	os << "#Generator";
+}
+
+void Task::print(std::ostream &os) const {
+	os << "#Task";
+}
+
+void Condition::report(std::ostream &os) const {
+	os << message;
+	for (Lobj *o = irritants.get(); o->typep<Cons>(); o = o->getAs<Cons>().cdrPtr()) {
+		os << " ";
+		o->getAs<Cons>().car->print(os);
+	}
+}
+
+void Condition::print(std::ostream &os) const {
+	os << "#<";
+	kind->print(os);
+	os << ": ";
+	report(os);
+	os << ">";
+}
+
+void Socket::print(std::ostream &os) const {
+	os << "#Socket";
+}
+
+void Listener::print(std::ostream &os) const {
+	os << "#Listener";
+}
+
+void InputPort::print(std::ostream &os) const {
+	os << "#InputPort";
+}
+
+void OutputPort::print(std::ostream &os) const {
+	os << "#OutputPort";
 }
 
 void Proc::print(std::ostream &os) const {
@@ -148,36 +916,126 @@ void BuiltinProc::print(std::ostream &os) const {
 	os << "#BuiltinProc";
 }
 
+void MemoProc::print(std::ostream &os) const {
+	os << "#MemoProc";
+}
+
 void Macro::print(std::ostream &os) const {
 	os << "#Macro";
 }
 
-bool Lobj::eq(Lobj *obj) const {
-	return this == obj;
+void Vector::print(std::ostream &os) const {
+	os << "#(";
+	for (size_t i = 0; i < elements.size(); ++i) {
+		if (i) os << " ";
+		elements[i]->print(os);
+	}
+	os << ")";
 }
 
-bool Int::eq(Lobj *obj) const {
-	return obj->typep<Int>() && value == obj->getAs<Int>().value;
+void IntVector::print(std::ostream &os) const {
+	os << "#i(";
+	for (size_t i = 0; i < elements.size(); ++i)
+		os << (i ? " " : "") << elements[i];
+	os << ")";
 }
 
-bool String::eq(Lobj *obj) const {
-	return obj->typep<String>() && value == obj->getAs<String>().value;
+void HashTable::print(std::ostream &os) const {
+	os << "#HashTable";
 }
 
-bool Lobj::isNil() const {
-	return this->typep<Symbol>() &&	this->getAs<Symbol>().name == "nil";
+void PVector::print(std::ostream &os) const {
+	os << "[";
+	for (size_t i = 0; i < value.size(); ++i) {
+		if (i) os << " ";
+		value[i]->print(os);
+	}
+	os << "]";
 }
 
+void PMap::print(std::ostream &os) const {
+	os << "{";
+	bool first = true;
+	value.forEach([&os, &first](const LobjSPtr &key, const LobjSPtr &value) {
+			if (!first) os << " ";
+			key->print(os);
+			os << " ";
+			value->print(os);
+			first = false;
+		});
+	os << "}";
+}
 
-int gensymId = 0;
-std::map<std::string, LobjSPtr> symbolMap;
-EnvSPtr rootEnv;
+void TransientVector::print(std::ostream &os) const {
+	os << "#TransientVector";
+}
+
+void TransientMap::print(std::ostream &os) const {
+	os << "#TransientMap";
+}
+
+void ByteVector::print(std::ostream &os) const {
+	os << "#u8(";
+	for (size_t i = 0; i < elements.size(); ++i)
+		os << (i ? " " : "") << static_cast<int>(elements[i]);
+	os << ")";
+}
+
+bool Lobj::eq(Lobj *obj) const {
+	return this == obj;
+}
+
+bool Int::eq(Lobj *obj) const {
+	return obj->typep<Int>() && value == obj->getAs<Int>().value;
+}
+
+bool Bignum::eq(Lobj *obj) const {
+	return obj->typep<Bignum>() && BigInt::compare(value, obj->getAs<Bignum>().value) == 0;
+}
+
+bool Float::eq(Lobj *obj) const {
+	return obj->typep<Float>() && value == obj->getAs<Float>().value;
+}
+
+bool String::eq(Lobj *obj) const {
+	if (obj == this) return true;
+	if (!obj->typep<String>()) return false;
+	const String &other = obj->getAs<String>();
+	return length == other.length && std::memcmp(data(), other.data(), length) == 0;
+}
+
+bool Lobj::isNil() const {
+	return this->typep<Symbol>() &&	this->getAs<Symbol>().name == "nil";
+}
+
+
+thread_local Interpreter *currentInterpreter = nullptr;
+
+Interpreter *Interpreter::current() {
+	return currentInterpreter;
+}
+
+EventLoop &Interpreter::eventLoop() {
+	if (events == nullptr)
+		events.reset(new EventLoop());
+	return *events;
+}
+
+Interpreter::Scope::Scope(Interpreter &interpreter)
+	: saved(currentInterpreter) {
+	currentInterpreter = &interpreter;
+}
+
+Interpreter::Scope::~Scope() {
+	currentInterpreter = saved;
+}
 
-LobjSPtr intern(std::string name) {
+LobjSPtr Interpreter::intern(const std::string &name) {
+	std::lock_guard<std::mutex> lock(symbolMutex);
 	auto it = symbolMap.find(name);
 	LobjSPtr objPtr;
 	if (it == symbolMap.end()) {
-		objPtr = std::make_shared<Symbol>(name);
+		objPtr = newObj<Symbol>(name);
 		symbolMap[name] = objPtr;
 	} else {
 		objPtr = it->second;
@@ -185,12 +1043,61 @@ LobjSPtr intern(std::string name) {
 	return objPtr;
 }
 
+LobjSPtr intern(const std::string &name) {
+	return currentInterpreter->intern(name);
+}
+
+const LobjSPtr &nil() {
+	return currentInterpreter->nilSymbol;
+}
+
+void reportError(std::ostream &os, const char *prefix);
+
+// A throw on its way to its catch. Inside the evaluator a throw travels as
+// a return value: evalOrUnwind returns nullptr while one is pending and
+// each frame passes that straight up, so leaving a deep search costs no
+// more than returning from it. Env::eval raises a pending throw as a
+// ThrowSignal for callers outside the evaluator.
+struct PendingThrow {
+	bool active = false;
+	LobjSPtr tag;
+	LobjSPtr value;
+};
+
+thread_local PendingThrow pendingThrow;
+
+[[noreturn]] void raisePendingThrow();
+
 class Env {
 	EnvWPtr self;
 	EnvSPtr outerEnv;
 	EnvSPtr lexEnv;
 	Fmap<Symbol*, LobjSPtr> symbolValueMap;
 	bool closed = true;
+	bool global = false;
+
+	bool hasBinding(Symbol *symbol) const {
+		return global ? symbol->globalValue != nullptr : symbolValueMap.count(symbol);
+	}
+
+	void printBindings() const {
+		if (global) {
+			for (auto &kv : currentInterpreter->symbolMap) {
+				if (kv.second->getAs<Symbol>().globalValue == nullptr) continue;
+				kv.second->print(std::cout);
+				std::cout << ":";
+				kv.second->getAs<Symbol>().globalValue->print(std::cout);
+				std::cout << ",";
+			}
+			return;
+		}
+		for(auto &kv : symbolValueMap) {
+			kv.first->print(std::cout);
+			std::cout << ":";
+			kv.second->print(std::cout);
+			std::cout << ",";
+		}
+	}
 
 public:
 	Env();
@@ -198,14 +1105,26 @@ public:
 		: outerEnv(e), lexEnv(l), closed(false) {}
 
 	static EnvSPtr makeEnv() {
+		chargeBytes(sizeof(Env));
 		EnvSPtr env = std::make_shared<Env>();
 		env->self = env;
+		trace::instant(trace::ENV, "env");
 		return env;
 	}
 
 	EnvSPtr makeInnerEnv(EnvSPtr l = nullptr) const {
+		chargeBytes(sizeof(Env));
 		EnvSPtr env = std::make_shared<Env>(EnvSPtr(self), l);
 		env->self = env;
+		trace::instant(trace::ENV, "env");
+		return env;
+	}
+
+	// A REPL session's environment: def binds into it instead of the root.
+	// Closed, so that tail calls never reuse it for their bindings.
+	EnvSPtr makeSessionEnv() const {
+		EnvSPtr env = makeInnerEnv();
+		env->closed = true;
 		return env;
 	}
 
@@ -217,15 +1136,20 @@ public:
 	}
 
 	EnvSPtr resolveEnvDyn(Symbol *symbol) const {
-		if (symbolValueMap.count(symbol))
+		if (hasBinding(symbol))
 			return EnvSPtr(self);
 		if (outerEnv != nullptr)
 			return outerEnv->resolveEnvDyn(symbol);
+		// Code applied from the root, such as a lazy-map callback, still
+		// sees the definitions of the session it runs for.
+		const EnvSPtr &session = currentInterpreter->sessionEnv;
+		if (global && session != nullptr && session->hasBinding(symbol))
+			return session;
 		return EnvSPtr(nullptr);
 	}
 
 	EnvSPtr resolveEnvLex(Symbol *symbol) const {
-		if (symbolValueMap.count(symbol))
+		if (hasBinding(symbol))
 			return EnvSPtr(self);
 		if (lexEnv != nullptr)
 			return lexEnv->resolveEnvLex(symbol);
@@ -237,20 +1161,37 @@ public:
 	LobjSPtr resolve(Symbol *symbol) {
 		EnvSPtr env = resolveEnv(symbol);
 		if (env == nullptr) return LobjSPtr(nullptr);
-		return env->symbolValueMap[symbol];
+		return env->global ? symbol->globalValue : env->symbolValueMap[symbol];
 	}
 
 	void bind(LobjSPtr objPtr, Symbol *symbol) {
-		symbolValueMap[symbol] = objPtr;
+		if (global)
+			symbol->globalValue = objPtr;
+		else
+			symbolValueMap[symbol] = objPtr;
+	}
+
+	// For heap-dump. Global bindings are held by the symbols themselves.
+	size_t size() const {
+		return sizeof(*this) + symbolValueMap.size() * sizeof(std::pair<Symbol*, LobjSPtr>);
+	}
+
+	void forEachRef(HeapWalker &walker) {
+		walker.ref(outerEnv);
+		walker.ref(lexEnv);
+		for (auto &kv : symbolValueMap) {
+			walker.ref(kv.first);
+			walker.ref(kv.second);
+		}
 	}
 
 	bool isSpecialVariable(Symbol *symbol) const {
-		return rootEnv->symbolValueMap.count(symbol);
+		return symbol->globalValue != nullptr || symbol->sessionDefined;
 	}
 
 	void merge(EnvSPtr env) {
 		for (auto &kv : env->symbolValueMap) {
-			symbolValueMap[kv.first] = kv.second;
+			bind(kv.second, kv.first);
 		}
 		if (env->lexEnv != nullptr)
 			lexEnv = env->lexEnv;
@@ -265,6 +1206,14 @@ public:
 		return closed;
 	}
 
+	void clearBindings() {
+		if (global) {
+			for (auto &kv : currentInterpreter->symbolMap)
+				kv.second->getAs<Symbol>().globalValue.reset();
+		}
+		symbolValueMap = Fmap<Symbol*, LobjSPtr>();
+	}
+
 	LobjSPtr read(std::istream &is);
 
 	/*	LobjSPtr macroexpand1(LobjSPtr objPtr);
@@ -272,36 +1221,50 @@ public:
 	LobjSPtr macroexpandAll(LobjSPtr objPtr);
 
 	LobjSPtr procSpecialForm(LobjSPtr objPtr, bool tail = false);
-	//LobjSPtr apply(LobjSPtr op, LobjSPtr args);
-	LobjSPtr eval(LobjSPtr objPtr, bool tail = false);
+	LobjSPtr apply(LobjSPtr opPtr, std::vector<LobjSPtr> &args);
+	// Returns nullptr, with pendingThrow set, when a throw leaves objPtr.
+	LobjSPtr evalOrUnwind(LobjSPtr objPtr, bool tail = false);
+
+	LobjSPtr eval(LobjSPtr objPtr, bool tail = false) {
+		LobjSPtr value = evalOrUnwind(std::move(objPtr), tail);
+		if (value == nullptr && pendingThrow.active)
+			raisePendingThrow();
+		return value;
+	}
+
+	void evalBody(Lobj *body) {
+		for (; body->typep<Cons>(); body = body->getAs<Cons>().cdrPtr())
+			eval(body->getAs<Cons>().car);
+	}
 
 	LobjSPtr evalTop(LobjSPtr objPtr) {
 		return eval(macroexpandAll(objPtr));
 	}
 
-	void repl() {
+	void repl(std::istream &is, std::ostream &os) {
+		LobjSPtr exitSymbol = intern("exit");
 		while (1) {
-			std::cout << "> ";
-			LobjSPtr o = read(std::cin);
+			os << "> ";
+			LobjSPtr o = read(is);
 			if (o == nullptr) {
-				std::cout << std::endl << "Parse failed." << std::endl;
+				os << std::endl << "Parse failed." << std::endl;
 				return;
 			}
-			o = evalTop(o);
-			o->print(std::cout);
-			std::cout << std::endl;
-			if (o == intern("exit")) break;
+			try {
+				o = evalTop(o);
+			} catch (...) {
+				reportError(os, "Error: ");
+				continue;
+			}
+			o->print(os);
+			os << std::endl;
+			if (o == exitSymbol) break;
 		}
 	}
 
 	void print() const {
 		std::cout << "{";
-		for(auto &kv : symbolValueMap) {
-			kv.first->print(std::cout);
-			std::cout << ":";
-			kv.second->print(std::cout);
-			std::cout << ",";
-		}
+		printBindings();
 		std::cout << "}";
 	}
 
@@ -311,12 +1274,7 @@ public:
 			return;
 		}
 		std::cout << "{";
-		for(auto &kv : symbolValueMap) {
-			kv.first->print(std::cout);
-			std::cout << ":";
-			kv.second->print(std::cout);
-			std::cout << ",";
-		}
+		printBindings();
 		if (lexEnv != nullptr) {
 			std::cout << "#lex:";
 			lexEnv->printAll(exceptRoot);
@@ -334,30 +1292,81 @@ bool isSymbolChar(const char c) {
 		c != '\t' && c != '\n' && c != '\r' && c != 0;
 }
 
+// Literal strings and quoted lists read from source. Entries are weak, so a
+// constant is freed with the last code that uses it; its entry goes at the
+// next sweep. A list is pooled after the lists in it, so its key is its
+// elements, followed by its tail, with the inner lists compared by
+// identity and atoms with eq?. The cells of pooled lists are shared by
+// every site that quotes an equal list, so they are recorded and the
+// mutators refuse them.
+struct ConstantPool {
+	// Strings are keyed by the buffer of the pooled String, so the
+	// characters are not stored twice.
+	typedef std::shared_ptr<const std::string> Buffer;
+
+	struct BufferHash {
+		size_t operator()(const Buffer &buffer) const;
+	};
+
+	struct BufferEqual {
+		bool operator()(const Buffer &a, const Buffer &b) const;
+	};
+
+	struct KeyHash {
+		size_t operator()(const std::vector<LobjSPtr> &key) const;
+	};
+
+	struct KeyEqual {
+		bool operator()(const std::vector<LobjSPtr> &a, const std::vector<LobjSPtr> &b) const;
+	};
+
+	struct CellHash {
+		size_t operator()(const Lobj *cell) const;
+	};
+
+	std::mutex mutex;
+	OpenHashMap<Buffer, LobjWPtr, BufferHash, BufferEqual> strings;
+	OpenHashMap<std::vector<LobjSPtr>, LobjWPtr, KeyHash, KeyEqual> lists;
+	// An expired entry may name an address since reused by a fresh cons.
+	OpenHashMap<const Lobj *, LobjWPtr, CellHash, std::equal_to<const Lobj *> > cells;
+	size_t sweepAt = 1024;
+
+	LobjSPtr string(std::string &&value);
+	// The structure of (quote x), shared with every equal one read before.
+	LobjSPtr quoted(const LobjSPtr &obj);
+	bool isConstant(const Lobj *cell);
+
+private:
+	LobjSPtr pool(const LobjSPtr &list);
+	void sweepIfFull();
+};
+
 LobjSPtr readAux(Env &env, std::istream &is);
 
 LobjSPtr readList(Env &env, std::istream &is) {
-	is >> std::ws;
-	if (is.eof()) throw "parse failed";
-	char c = is.get();
-	if (c == ')') {
-		return intern("nil");
-	} else if (c == '.') {
-		LobjSPtr cdr = readAux(env, is);
+	std::vector<LobjSPtr> elements;
+	while (1) {
 		is >> std::ws;
-		if (is.get() != ')') throw "parse failed";
-		return cdr;
-	} else {
+		if (is.eof()) throw "parse failed";
+		char c = is.get();
+		if (c == ')') {
+			if (elements.size() == 2 && elements[0]->typep<Symbol>() && elements[0]->getAs<Symbol>().name == "quote")
+				elements[1] = currentInterpreter->constants->quoted(elements[1]);
+			return makeList(elements, nil());
+		} else if (c == '.') {
+			LobjSPtr cdr = readAux(env, is);
+			is >> std::ws;
+			if (is.get() != ')') throw "parse failed";
+			return makeList(elements, cdr);
+		}
 		is.unget();
-		LobjSPtr car = readAux(env, is);
-		LobjSPtr cdr = readList(env, is);
-		return LobjSPtr(new Cons(car, cdr));
+		elements.push_back(readAux(env, is));
 	}
 }
 
 LobjSPtr readString(Env &env, std::istream &is) {
 	char c = is.get();
-	std::stringstream ss;
+	std::string str;
 	while (c != '"') {
 		if (c == '\\') {
 			switch (c = is.get()) {
@@ -372,11 +1381,11 @@ LobjSPtr readString(Env &env, std::istream &is) {
 			case '\n': case '\r': c = 0; break;
 			}
 		}
-		if (c != 0) ss << c;
+		if (c != 0) str.push_back(c);
 		if (is.eof()) throw "parse failed";
 		c = is.get();
 	}
-	return LobjSPtr(new String(ss.str()));
+	return currentInterpreter->constants->string(std::move(str));
 }
 
 void skipCommentOut(std::istream &is) {
@@ -389,7 +1398,37 @@ void skipCommentOut(std::istream &is) {
 	}
 }
 
+LobjSPtr readNumber(std::istream &is) {
+	std::string token(1, is.get());
+	bool isFloat = false;
+	while (1) {
+		int c = is.peek();
+		if (c == '.' || c == 'e' || c == 'E')
+			isFloat = true;
+		else if ((c == '-' || c == '+') && (token.back() == 'e' || token.back() == 'E'))
+			;
+		else if (c < '0' || '9' < c)
+			break;
+		token.push_back(is.get());
+	}
+	char *end;
+	if (isFloat) {
+		double value = std::strtod(token.c_str(), &end);
+		if (*end != 0) throw "parse failed";
+		return newObj<Float>(value);
+	}
+	errno = 0;
+	long long value = std::strtoll(token.c_str(), &end, 10);
+	if (errno == ERANGE) {
+		BigInt big;
+		BigInt::parse(token, big);
+		return newObj<Bignum>(big);
+	}
+	return makeInt(value);
+}
+
 LobjSPtr readAux(Env &env, std::istream &is) {
+	if (coro::Coroutine::stackExhausted()) throw "stack overflow";
 	skipCommentOut(is);
 	if (is.eof()) throw "parse failed";
 	char c = is.get();
@@ -398,21 +1437,17 @@ LobjSPtr readAux(Env &env, std::istream &is) {
 	} else if (('0' <= c && c <= '9') ||
 						 (c == '-' && ('0' <= is.peek() && is.peek() <= '9'))) {
 		is.unget();
-		int value;
-		is >> value;
-		return LobjSPtr(new Int(value));
+		return readNumber(is);
 	} else if (c == '"') {
 		return readString(env, is);
 	} else {
-		char symbolName[512];
-		int i = 0;
-		while (isSymbolChar(c) && !is.eof()) {
-			symbolName[i++] = c;
+		std::string symbolName;
+		while (isSymbolChar(c) && is.good()) {
+			symbolName.push_back(c);
 			c = is.get();
 		}
 		is.unget();
-		if (i == 0) throw "parse fialed";
-		symbolName[i] = 0;
+		if (symbolName.empty()) throw "parse fialed";
 		return intern(symbolName);
 	}
 }
@@ -426,329 +1461,2812 @@ LobjSPtr Env::read(std::istream &is) {
 }
 
 LobjSPtr listLastCdrObj(LobjSPtr objPtr) {
-	if (objPtr->typep<Cons>())
-		return listLastCdrObj(objPtr->getAs<Cons>().cdr);
+	while (objPtr->typep<Cons>())
+		objPtr = cdrOf(objPtr);
 	return objPtr;
 }
 
 bool isProperList(Lobj *obj) {
-	if (typeid(*obj) == typeid(Cons))
-		return isProperList(dynamic_cast<Cons*>(obj)->cdr.get());
-	if (typeid(*obj) == typeid(Symbol))
-		return dynamic_cast<Symbol*>(obj)->name == "nil";
-	return false;
+	while (typeid(*obj) == typeid(Cons))
+		obj = obj->getAs<Cons>().cdrPtr();
+	return obj->isNil();
 }
 
 int listLength(Lobj *obj) {
-	if (typeid(*obj) == typeid(Cons))
-		return 1 + listLength(dynamic_cast<Cons*>(obj)->cdr.get());
-	return 0;
+	int length = 0;
+	for (; typeid(*obj) == typeid(Cons); obj = obj->getAs<Cons>().cdrPtr())
+		++length;
+	return length;
 }
 
 LobjSPtr listNth(LobjSPtr &objptr, int i) {
-	if (typeid(*objptr) != typeid(Cons))
+	Lobj *obj = objptr.get();
+	for (; i > 0 && typeid(*obj) == typeid(Cons); --i)
+		obj = obj->getAs<Cons>().cdrPtr();
+	if (typeid(*obj) != typeid(Cons))
 		return LobjSPtr(nullptr);
-	if (i == 0)
-		return dynamic_cast<Cons*>(objptr.get())->car;
-	return listNth(dynamic_cast<Cons*>(objptr.get())->cdr, i - 1);
+	return obj->getAs<Cons>().car;
 }
 
 LobjSPtr listNthCdr(LobjSPtr &objptr, int i) {
-	if (i == 0)
-		return objptr;
-	if (typeid(*objptr) != typeid(Cons))
-		return LobjSPtr(nullptr);
-	return listNthCdr(dynamic_cast<Cons*>(objptr.get())->cdr, i - 1);
+	LobjSPtr obj = objptr;
+	for (; i > 0; --i) {
+		if (typeid(*obj) != typeid(Cons))
+			return LobjSPtr(nullptr);
+		obj = cdrOf(obj);
+	}
+	return obj;
 }
 
 LobjSPtr map(LobjSPtr objPtr, std::function<LobjSPtr(LobjSPtr)> func) {
-	if (typeid(*objPtr) != typeid(Cons))
-		return objPtr;
-	Cons *cons = dynamic_cast<Cons*>(objPtr.get());
-	return std::make_shared<Cons>(func(cons->car), map(cons->cdr, func));
+	std::vector<LobjSPtr> elements;
+	for (; typeid(*objPtr) == typeid(Cons); objPtr = cdrOf(objPtr))
+		elements.push_back(func(objPtr->getAs<Cons>().car));
+	return makeList(elements, objPtr);
 }
 
 LobjSPtr boolToLobj(bool b) {
-	return intern(b ? "t" : "nil");
+	return b ? currentInterpreter->tSymbol : currentInterpreter->nilSymbol;
 }
 
-LobjSPtr evalListElements(EnvSPtr env, LobjSPtr objPtr) {
-	if (typeid(*objPtr) != typeid(Cons)) return objPtr;
-	Cons *cons = dynamic_cast<Cons*>(objPtr.get());
-	return std::make_shared<Cons>(env->eval(cons->car), evalListElements(env, cons->cdr));
+bool isInteger(Lobj *obj) {
+	return obj->typep<Int>() || obj->typep<Bignum>();
 }
 
-LobjSPtr vectorToList(std::vector<LobjSPtr> &v) {
-	LobjSPtr list = intern("nil");
-	for (auto it = v.rbegin(); it != v.rend(); ++it) {
-		list = std::make_shared<Cons>(*it, list);
+bool isNumber(Lobj *obj) {
+	return obj->typep<Int>() || obj->typep<Bignum>() || obj->typep<Float>();
+}
+
+// Anything Env::apply can call.
+bool isCallable(Lobj *obj) {
+	return obj->typep<Proc>() || obj->typep<BuiltinProc>() || obj->typep<MemoProc>();
+}
+
+// Bignums are always kept out of the int64 range so equal integers share a representation.
+LobjSPtr normalizeBigInt(const BigInt &value) {
+	if (value.fitsInt64())
+		return makeInt(value.toInt64());
+	return newObj<Bignum>(value);
+}
+
+BigInt toBigInt(Lobj *obj) {
+	if (obj->typep<Int>())
+		return BigInt(obj->getAs<Int>().value);
+	return obj->getAs<Bignum>().value;
+}
+
+double toDouble(Lobj *obj) {
+	if (obj->typep<Int>())
+		return static_cast<double>(obj->getAs<Int>().value);
+	if (obj->typep<Bignum>())
+		return obj->getAs<Bignum>().value.toDouble();
+	return obj->getAs<Float>().value;
+}
+
+// Generic binary arithmetic over the numeric tower. `op` is one of + - * / %.
+// Int results that overflow are promoted to Bignum; any Float operand yields a Float.
+LobjSPtr numArith(char op, Lobj *x, Lobj *y, const char *error) {
+	if (!isNumber(x) || !isNumber(y)) throw error;
+	if (x->typep<Float>() || y->typep<Float>()) {
+		double a = toDouble(x), b = toDouble(y);
+		switch (op) {
+		case '+': return newObj<Float>(a + b);
+		case '-': return newObj<Float>(a - b);
+		case '*': return newObj<Float>(a * b);
+		case '/': return newObj<Float>(a / b);
+		default: return newObj<Float>(std::fmod(a, b));
+		}
 	}
-	return list;
+	if (x->typep<Int>() && y->typep<Int>()) {
+		int64_t a = x->getAs<Int>().value, b = y->getAs<Int>().value, r;
+		switch (op) {
+		case '+':
+			if (!__builtin_add_overflow(a, b, &r)) return makeInt(r);
+			break;
+		case '-':
+			if (!__builtin_sub_overflow(a, b, &r)) return makeInt(r);
+			break;
+		case '*':
+			if (!__builtin_mul_overflow(a, b, &r)) return makeInt(r);
+			break;
+		case '/':
+			if (b == 0) throw "dividing by zero";
+			if (b != -1) return makeInt(a / b);
+			break;
+		default:
+			if (b == 0) throw "dividing by zero";
+			return makeInt(b == -1 ? 0 : a % b);
+		}
+	}
+	BigInt a = toBigInt(x), b = toBigInt(y), q, r;
+	switch (op) {
+	case '+': return normalizeBigInt(a + b);
+	case '-': return normalizeBigInt(a - b);
+	case '*': return normalizeBigInt(a * b);
+	}
+	if (b.isZero()) throw "dividing by zero";
+	BigInt::divMod(a, b, q, r);
+	return normalizeBigInt(op == '/' ? q : r);
 }
 
-EnvSPtr makeEnvForMacro(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
-	EnvSPtr env = outerEnv->makeInnerEnv(procEnv);
-	if (!isProperList(args.get()))
-		throw "bad macro apply";
-	while (prms->typep<Cons>() && args->typep<Cons>()) {
-		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
-		env->bind(args->getAs<Cons>().car, symbol);
-		prms = prms->getAs<Cons>().cdr;
-		args = args->getAs<Cons>().cdr;
+int numCompare(Lobj *x, Lobj *y) {
+	if (x->typep<Int>() && y->typep<Int>()) {
+		int64_t a = x->getAs<Int>().value, b = y->getAs<Int>().value;
+		return a < b ? -1 : a > b ? 1 : 0;
 	}
-	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
-		env->bind(args, &prms->getAs<Symbol>());
+	if (x->typep<Float>() || y->typep<Float>()) {
+		double a = toDouble(x), b = toDouble(y);
+		return a < b ? -1 : a > b ? 1 : a == b ? 0 : 2;
 	}
-	if (tail && !outerEnv->isClosed()) {
-		outerEnv->merge(env);
-		env = outerEnv;
+	return BigInt::compare(toBigInt(x), toBigInt(y));
+}
+
+bool isVector(Lobj *obj) {
+	return obj->typep<Vector>() || obj->typep<IntVector>() || obj->typep<ByteVector>();
+}
+
+size_t vectorLength(Lobj *obj) {
+	if (obj->typep<Vector>()) return obj->getAs<Vector>().elements.size();
+	if (obj->typep<IntVector>()) return obj->getAs<IntVector>().elements.size();
+	return obj->getAs<ByteVector>().elements.size();
+}
+
+size_t toIndex(Lobj *obj, size_t limit, const char *error) {
+	if (!obj->typep<Int>()) throw error;
+	int64_t i = obj->getAs<Int>().value;
+	if (i < 0 || static_cast<uint64_t>(i) > limit) throw "index out of range";
+	return i;
+}
+
+int64_t toInt64Element(Lobj *obj, const char *error) {
+	if (!obj->typep<Int>()) throw error;
+	return obj->getAs<Int>().value;
+}
+
+uint8_t toByteElement(Lobj *obj, const char *error) {
+	if (!obj->typep<Int>() || obj->getAs<Int>().value < 0 || 255 < obj->getAs<Int>().value)
+		throw error;
+	return obj->getAs<Int>().value;
+}
+
+LobjSPtr int128ToLobj(__int128 value) {
+	if (static_cast<int64_t>(value) == value)
+		return makeInt(static_cast<int64_t>(value));
+	uint64_t low = static_cast<uint64_t>(value);
+	BigInt r = BigInt(static_cast<int64_t>(value >> 64)) * BigInt(static_cast<int64_t>(1) << 32) * BigInt(static_cast<int64_t>(1) << 32);
+	r = r + BigInt(static_cast<int64_t>(low >> 32)) * BigInt(static_cast<int64_t>(1) << 32) + BigInt(static_cast<int64_t>(low & 0xffffffff));
+	return normalizeBigInt(r);
+}
+
+// Applies + - * elementwise to two vectors of the same type and length.
+LobjSPtr vectorArith(char op, std::vector<LobjSPtr> &args, const char *error) {
+	if (args.size() != 2 || !isVector(args[0].get()) || typeid(*args[0]) != typeid(*args[1]))
+		throw error;
+	size_t n = vectorLength(args[0].get());
+	if (vectorLength(args[1].get()) != n) throw error;
+	const simd::Kernels &k = simd::kernels();
+	if (args[0]->typep<IntVector>()) {
+		const int64_t *a = args[0]->getAs<IntVector>().elements.data(), *b = args[1]->getAs<IntVector>().elements.data();
+		auto r = newObj<IntVector>(n);
+		bool ok = op == '+' ? k.addInt64(a, b, r->elements.data(), n) :
+			op == '-' ? k.subInt64(a, b, r->elements.data(), n) : simd::mulInt64(a, b, r->elements.data(), n);
+		if (!ok) throw "integer overflow in int-vector arithmetic";
+		return r;
 	}
-	return env;
+	if (args[0]->typep<ByteVector>()) {
+		const uint8_t *a = args[0]->getAs<ByteVector>().elements.data(), *b = args[1]->getAs<ByteVector>().elements.data();
+		auto r = newObj<ByteVector>(n);
+		if (op == '+') k.addBytes(a, b, r->elements.data(), n);
+		else if (op == '-') k.subBytes(a, b, r->elements.data(), n);
+		else simd::mulBytes(a, b, r->elements.data(), n);
+		return r;
+	}
+	std::vector<LobjSPtr> &a = args[0]->getAs<Vector>().elements, &b = args[1]->getAs<Vector>().elements;
+	auto r = newObj<Vector>(n, nullptr);
+	for (size_t i = 0; i < n; ++i)
+		r->elements[i] = numArith(op, a[i].get(), b[i].get(), error);
+	return r;
 }
-/*
-EnvSPtr makeEnvForApply(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
-	if (!isProperList(args.get()))
-		throw "bad apply";
-	int prmsLength = listLength(prms.get());
-	int argsLength = listLength(args.get());
-	if (argsLength < prmsLength) throw "arguments is fewer";
-	std::vector<LobjSPtr> evaledArgs(prmsLength);
-	for (int i = 0; i < prmsLength; ++i) {
-		evaledArgs[i] = outerEnv->eval(args->getAs<Cons>().car);
-		args = args->getAs<Cons>().cdr;
+
+// Returns the minimum (sign < 0) or maximum (sign > 0) element, or nil for an empty vector.
+LobjSPtr vectorExtreme(int sign, std::vector<LobjSPtr> &args, const char *error) {
+	if (args.size() != 1 || !isVector(args[0].get()))
+		throw error;
+	if (vectorLength(args[0].get()) == 0)
+		return nil();
+	if (args[0]->typep<IntVector>()) {
+		std::vector<int64_t> &v = args[0]->getAs<IntVector>().elements;
+		int64_t sum, min, max;
+		simd::kernels().reduceInt64(v.data(), v.size(), sum, min, max);
+		return makeInt(sign < 0 ? min : max);
 	}
-	LobjSPtr argsRest = evalListElements(outerEnv, args);
-	EnvSPtr env;
-	if (tail && !outerEnv->isClosed()) {
-		env = outerEnv;
-		env->setLexEnv(procEnv);
-	} else {
-		env = outerEnv->makeInnerEnv(procEnv);
+	if (args[0]->typep<ByteVector>()) {
+		std::vector<uint8_t> &v = args[0]->getAs<ByteVector>().elements;
+		uint8_t min, max;
+		simd::kernels().minMaxBytes(v.data(), v.size(), min, max);
+		return makeInt(sign < 0 ? min : max);
 	}
-	for (auto &evaledArg : evaledArgs) {
-		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
-		env->bind(evaledArg, symbol);
-		prms = prms->getAs<Cons>().cdr;
+	std::vector<LobjSPtr> &v = args[0]->getAs<Vector>().elements;
+	LobjSPtr r = v[0];
+	for (LobjSPtr &x : v) {
+		if (!isNumber(x.get())) throw error;
+		if (numCompare(x.get(), r.get()) == sign) r = x;
 	}
-	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
-		env->bind(argsRest, &prms->getAs<Symbol>());
+	return r;
+}
+
+// Appends the printed form of args[from..] to `out`. Strings are copied as is.
+void appendPrinted(std::string &out, std::vector<LobjSPtr> &args, size_t from) {
+	StringSink sink(out);
+	std::ostream os(&sink);
+	for (size_t i = from; i < args.size(); ++i) {
+		if (args[i]->typep<String>())
+			out.append(args[i]->getAs<String>().data(), args[i]->getAs<String>().length);
+		else
+			args[i]->print(os);
 	}
-	return env;
-}//*/
-//*
-EnvSPtr makeEnvForApply(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
-	EnvSPtr env = outerEnv->makeInnerEnv(procEnv);
-	if (!isProperList(args.get()))
-		throw "bad apply";
-	while (prms->typep<Cons>() && args->typep<Cons>()) {
-		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
-		env->bind(outerEnv->eval(args->getAs<Cons>().car), symbol);
-		prms = prms->getAs<Cons>().cdr;
-		args = args->getAs<Cons>().cdr;
+}
+
+LobjSPtr substring(const String &str, size_t start, size_t end) {
+	return newObj<String>(str.buffer, str.offset + start, end - start);
+}
+
+// Index of the first occurrence of pattern at or after start, or
+// std::string::npos if there is none. An empty pattern matches at start,
+// even when start is the end of the string.
+size_t findString(const String &str, const String &pattern, size_t start) {
+	const uint8_t *p = reinterpret_cast<const uint8_t*>(str.data());
+	const uint8_t *q = reinterpret_cast<const uint8_t*>(pattern.data());
+	size_t n = str.length - start;
+	size_t i = simd::findSequence(p + start, n, q, pattern.length);
+	return i == n && pattern.length != 0 ? std::string::npos : start + i;
+}
+
+std::istream &inputStream(Lobj *obj, const char *error) {
+	if (obj->typep<Socket>()) {
+		if (obj->getAs<Socket>().buf == nullptr) throw "port is closed";
+		return obj->getAs<Socket>().in;
 	}
-	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
-		LobjSPtr rest = evalListElements(outerEnv, args);
-		env->bind(rest, &prms->getAs<Symbol>());
+	if (!obj->typep<InputPort>()) throw error;
+	if (obj->getAs<InputPort>().buf == nullptr) throw "port is closed";
+	return obj->getAs<InputPort>().stream;
+}
+
+std::ostream &outputStream(Lobj *obj, const char *error) {
+	if (obj->typep<Socket>()) {
+		if (obj->getAs<Socket>().buf == nullptr) throw "port is closed";
+		return obj->getAs<Socket>().out;
 	}
-	if (tail && !outerEnv->isClosed()) {
-		outerEnv->merge(env);
-		env = outerEnv;
+	if (!obj->typep<OutputPort>()) throw error;
+	if (obj->getAs<OutputPort>().buf == nullptr) throw "port is closed";
+	return obj->getAs<OutputPort>().stream;
+}
+
+// The port passed as args[i], or the default port if there is no such argument.
+std::istream &inputArg(std::vector<LobjSPtr> &args, size_t i, const char *error) {
+	return inputStream(i < args.size() ? args[i].get() : currentInterpreter->stdinPort.get(), error);
+}
+
+std::ostream &outputArg(std::vector<LobjSPtr> &args, size_t i, const char *error) {
+	return outputStream(i < args.size() ? args[i].get() : currentInterpreter->currentOutputPort.get(), error);
+}
+
+// Where the evaluator prints diagnostics: the current output port, which
+// in a server session is the client's socket, or standard output once
+// that port has been closed.
+std::ostream &diagnosticStream() {
+	Lobj *port = currentInterpreter->currentOutputPort.get();
+	if ((port->typep<OutputPort>() && port->getAs<OutputPort>().buf != nullptr) ||
+			(port->typep<Socket>() && port->getAs<Socket>().buf != nullptr))
+		return outputStream(port, "");
+	return std::cout;
+}
+
+// Returns nullptr if the file cannot be opened.
+LobjSPtr openFilePort(const std::string &path, bool output) {
+	std::shared_ptr<std::streambuf> buf(FdStreamBuf::open(path, output));
+	if (buf == nullptr) return nullptr;
+	if (output) return newObj<OutputPort>(buf);
+	return newObj<InputPort>(buf);
+}
+
+// Makes `port` the current output port for the lifetime of the object.
+class OutputRedirect {
+	LobjSPtr saved;
+
+public:
+	OutputRedirect (const LobjSPtr &port)
+	: saved(currentInterpreter->currentOutputPort) {
+		currentInterpreter->currentOutputPort = port;
 	}
-	return env;
-}//*/
 
+	~OutputRedirect () {
+		currentInterpreter->currentOutputPort = saved;
+	}
+};
+
+LobjSPtr Promise::force() {
+	if (value == nullptr) {
+		// The expression may force this promise again; the first value wins.
+		EnvSPtr e = env;
+		LobjSPtr v = e->eval(expr);
+		if (value == nullptr) {
+			value = v;
+			expr.reset();
+			env.reset();
+		}
+	}
+	return value;
+}
+
+// Steps through a list, a LazySeq, a stream of conses whose cdr is a
+// promise, or the values yielded by a generator. On success stores the
+// first element in `head`, moves `seq` to the rest and returns true;
+// returns false at the end.
+bool seqNext(LobjSPtr &seq, LobjSPtr &head, const char *error) {
+	if (seq->typep<Generator>()) {
+		head = nil();
+		return seq->getAs<Generator>().resume(head);
+	}
+	if (seq->typep<LazySeq>())
+		seq = seq->getAs<LazySeq>().force();
+	if (seq->isNil())
+		return false;
+	if (!seq->typep<Cons>())
+		throw error;
+	head = seq->getAs<Cons>().car;
+	LobjSPtr rest = cdrOf(seq);
+	if (rest->typep<Promise>())
+		rest = rest->getAs<Promise>().force();
+	seq = rest;
+	return true;
+}
+
+// The callbacks of lazy-map and lazy-filter are applied in `env`, the
+// environment of the call that created the sequence, as other builtins
+// taking a function apply it in their caller's.
+LobjSPtr lazyMap(LobjSPtr func, LobjSPtr seq, EnvSPtr env) {
+	return newObj<LazySeq>([func, seq, env]() mutable -> LobjSPtr {
+			LobjSPtr head;
+			if (!seqNext(seq, head, "bad arguments for function 'lazy-map'"))
+				return nil();
+			std::vector<LobjSPtr> args{head};
+			LobjSPtr value = env->apply(func, args);
+			return newObj<Cons>(value, lazyMap(func, seq, env));
+		});
+}
+
+LobjSPtr lazyFilter(LobjSPtr pred, LobjSPtr seq, EnvSPtr env) {
+	return newObj<LazySeq>([pred, seq, env]() mutable -> LobjSPtr {
+			LobjSPtr head;
+			while (seqNext(seq, head, "bad arguments for function 'lazy-filter'")) {
+				std::vector<LobjSPtr> args{head};
+				if (!env->apply(pred, args)->isNil())
+					return newObj<Cons>(head, lazyFilter(pred, seq, env));
+			}
+			return nil();
+		});
+}
+
+LobjSPtr lazyTake(int64_t n, LobjSPtr seq) {
+	return newObj<LazySeq>([n, seq]() mutable -> LobjSPtr {
+			LobjSPtr head;
+			if (n <= 0 || !seqNext(seq, head, "bad arguments for function 'take'"))
+				return nil();
+			return newObj<Cons>(head, lazyTake(n - 1, seq));
+		});
+}
+
+LobjSPtr lazyRange(int64_t start, int64_t end, bool bounded) {
+	return newObj<LazySeq>([start, end, bounded]() -> LobjSPtr {
+			if (bounded && end <= start)
+				return nil();
+			return newObj<Cons>(makeInt(start), lazyRange(start + 1, end, bounded));
+		});
+}
+
+LobjSPtr portLines(LobjSPtr port) {
+	return newObj<LazySeq>([port]() -> LobjSPtr {
+			std::string line;
+			if (!std::getline(inputStream(port.get(), "bad arguments for function 'port-lines'"), line))
+				return nil();
+			return newObj<Cons>(newObj<String>(std::move(line)), portLines(port));
+		});
+}
+
+LobjSPtr Future::touch() {
+	ThreadPool::shared().helpUntil([this] { return done.load(std::memory_order_acquire); });
+	if (error) std::rethrow_exception(error);
+	return value;
+}
+
+// Thrown out of yield in a generator destroyed while suspended, to unwind
+// the frames left on its stack.
+struct GeneratorCancel {};
+
+// A pending throw that has to leave through native frames: a builtin that
+// called back into Lisp, a generator or the embedding API.
+struct ThrowSignal {
+	LobjSPtr tag;
+	LobjSPtr value;
+};
+
+void raisePendingThrow() {
+	ThrowSignal signal{std::move(pendingThrow.tag), std::move(pendingThrow.value)};
+	pendingThrow.active = false;
+	throw signal;
+}
+
+// The condition for the exception being handled; call in a catch (...)
+// block. Anything that is not an error is rethrown: throw, and the
+// unwinding of cancelled generators and tasks, go past every handler.
+LobjSPtr currentCondition() {
+	try {
+		throw;
+	} catch (char const *e) {
+		return newObj<Condition>(intern("error"), e, nil());
+	} catch (LimitExceeded &e) {
+		return newObj<Condition>(intern("limit-exceeded"), e.message, nil());
+	} catch (LispError &e) {
+		return e.condition;
+	}
+}
+
+// Prints the error being handled, like currentCondition rethrowing what is
+// not one. A throw with no catch is reported too.
+void reportError(std::ostream &os, const char *prefix) {
+	try {
+		throw;
+	} catch (ThrowSignal &s) {
+		os << prefix << "no catch for tag ";
+		s.tag->print(os);
+		os << std::endl;
+	} catch (...) {
+		LobjSPtr condition = currentCondition();
+		os << prefix;
+		condition->getAs<Condition>().report(os);
+		os << std::endl;
+	}
+}
+
+thread_local Generator *currentGenerator = nullptr;
+
+Generator::Generator(LobjSPtr t, EnvSPtr e)
+: thunk(t), env(e), coroutine([this]() {
+		std::vector<LobjSPtr> args;
+		transfer = env->apply(thunk, args);
+	}) {}
+
+Generator::~Generator() {
+	cancelled = true;
+	// The generator may be dropped by a frame returning with a throw
+	// pending; its cleanup forms must not see that throw.
+	PendingThrow pending;
+	std::swap(pending, pendingThrow);
+	while (coroutine.isStarted() && !coroutine.isFinished()) {
+		try {
+			LobjSPtr value;
+			resume(value);
+		} catch (...) {}
+	}
+	std::swap(pending, pendingThrow);
+}
+
+// Runs the generator until it yields or returns, passing `value` in as the
+// result of the pending yield and replacing it with the value handed back.
+// Returns false once the thunk has returned.
+bool Generator::resume(LobjSPtr &value) {
+	if (coroutine.isRunning())
+		throw "generator is already running";
+	if (coroutine.isFinished()) {
+		value = nil();
+		return false;
+	}
+	transfer = value;
+	Generator *saved = currentGenerator;
+	Budget *savedBudget = currentBudget;
+	currentGenerator = this;
+	// Without a budget of its own, the generator runs on the resumer's.
+	resumerBudget = currentBudget;
+	if (ownBudget != nullptr)
+		currentBudget = ownBudget;
+	try {
+		coroutine.resume();
+	} catch (...) {
+		currentGenerator = saved;
+		currentBudget = savedBudget;
+		ownBudget = nullptr;
+		throw;
+	}
+	currentGenerator = saved;
+	ownBudget = currentBudget != savedBudget ? currentBudget : nullptr;
+	currentBudget = savedBudget;
+	value = std::move(transfer);
+	return !coroutine.isFinished();
+}
+
+LobjSPtr Generator::yield(LobjSPtr value) {
+	transfer = std::move(value);
+	coroutine.yield();
+	if (cancelled)
+		throw GeneratorCancel();
+	return std::move(transfer);
+}
+
+// Puts a budget in place for the extent of one with-limits. It is capped by
+// what is left of the enclosing budget, which is charged for what this one
+// used when it ends.
+struct BudgetScope {
+	Budget budget;
+	Budget *previous;
+	// Set if the enclosing budget is that of the generator's resumer. The
+	// generator may have been resumed by someone else by the time the scope
+	// ends, so it goes back to the current resumer's instead.
+	bool inherited;
+
+	BudgetScope (const Limits &limits)
+	: previous(currentBudget),
+		inherited(currentGenerator != nullptr && currentBudget == currentGenerator->resumerBudget) {
+		if (limits.steps != 0)
+			budget.maxSteps = std::min(limits.steps, Budget::unlimited);
+		if (limits.bytes != 0)
+			budget.maxBytes = std::min(limits.bytes, Budget::unlimited);
+		if (limits.ms != 0) {
+			budget.timed = true;
+			budget.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.ms);
+		}
+		if (previous != nullptr) {
+			budget.maxSteps = std::min(budget.maxSteps, previous->maxSteps - std::min(previous->steps, previous->maxSteps));
+			budget.maxBytes = std::min(budget.maxBytes, previous->maxBytes - std::min(previous->bytes, previous->maxBytes));
+			if (previous->timed && (!budget.timed || previous->deadline < budget.deadline)) {
+				budget.timed = true;
+				budget.deadline = previous->deadline;
+			}
+		}
+		budget.check();
+		currentBudget = &budget;
+	}
+
+	~BudgetScope () {
+		Budget *outer = inherited ? currentGenerator->resumerBudget : previous;
+		if (outer != nullptr) {
+			outer->steps += budget.steps;
+			outer->bytes += budget.bytes;
+		}
+		currentBudget = outer;
+	}
+};
+
+Task::Task(LobjSPtr t, EnvSPtr e)
+: EventLoop::Task([this]() {
+		std::vector<LobjSPtr> args;
+		try {
+			value = env->apply(thunk, args);
+		} catch (...) {
+			reportError(std::cerr, "Error in task: ");
+		}
+	}), interpreter(currentInterpreter), thunk(t), env(e), session(interpreter->sessionEnv),
+	input(interpreter->stdinPort), output(interpreter->currentOutputPort) {}
+
+void Task::resume() {
+	Interpreter::Scope scope(*interpreter);
+	struct Context {
+		Task &task;
+		Generator *generator;
+		Budget *budget;
+		PendingThrow pending;
+
+		Context (Task &t)
+		: task(t), generator(currentGenerator), budget(currentBudget) {
+			swap();
+			std::swap(pending, pendingThrow);
+			// A yield in the task must not reach a generator that happened
+			// to be running when the loop picked the task up.
+			currentGenerator = nullptr;
+			currentBudget = task.budget;
+		}
+
+		~Context () {
+			task.budget = currentBudget;
+			currentBudget = budget;
+			currentGenerator = generator;
+			std::swap(pending, pendingThrow);
+			swap();
+		}
+
+		void swap() {
+			std::swap(task.interpreter->sessionEnv, task.session);
+			std::swap(task.interpreter->stdinPort, task.input);
+			std::swap(task.interpreter->currentOutputPort, task.output);
+		}
+	} context(*this);
+	EventLoop::Task::resume();
+}
+
+// A port number on 127.0.0.1 or a Unix socket path.
+EventLoop::Address socketAddress(Lobj *obj, const char *error) {
+	if (obj->typep<Int>()) {
+		int64_t port = obj->getAs<Int>().value;
+		if (port < 0 || port > 65535) throw error;
+		return EventLoop::Address::tcp(static_cast<int>(port));
+	}
+	EventLoop::Address address;
+	if (!obj->typep<String>() || !EventLoop::Address::local(obj->getAs<String>().str(), address))
+		throw error;
+	return address;
+}
+
+// Set up around every task run on the shared pool. The thread running it
+// may be one that is waiting in touch or pmap in the middle of its own
+// evaluation; a yield or throw in the task must not reach that
+// evaluation's generator or catch, and pool work is not charged to its
+// with-limits budget.
+struct PoolTaskScope {
+	Interpreter::Scope scope;
+	Generator *generator;
+	Budget *budget;
+	PendingThrow pending;
+
+	PoolTaskScope (Interpreter &interpreter)
+	: scope(interpreter), generator(currentGenerator), budget(currentBudget) {
+		currentGenerator = nullptr;
+		currentBudget = nullptr;
+		std::swap(pending, pendingThrow);
+	}
+
+	~PoolTaskScope () {
+		currentGenerator = generator;
+		currentBudget = budget;
+		std::swap(pending, pendingThrow);
+	}
+};
+
+// Calls body(begin, end) for chunks covering [0, n) on the shared pool and
+// waits for all of them, running chunks on this thread as well. The first
+// error thrown by a chunk is rethrown here.
+void parallelFor(size_t n, const std::function<void(size_t, size_t)> &body) {
+	ThreadPool &pool = ThreadPool::shared();
+	size_t chunks = std::min(n, pool.size() * 4);
+	std::atomic<size_t> remaining(chunks);
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	Interpreter *interpreter = currentInterpreter;
+	for (size_t c = 0; c < chunks; ++c) {
+		size_t begin = n * c / chunks, end = n * (c + 1) / chunks;
+		pool.submit([&, begin, end, interpreter]() {
+				PoolTaskScope scope(*interpreter);
+				try {
+					body(begin, end);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error) error = std::current_exception();
+				}
+				remaining.fetch_sub(1, std::memory_order_release);
+			});
+	}
+	pool.helpUntil([&remaining] { return remaining.load(std::memory_order_acquire) == 0; });
+	if (error) std::rethrow_exception(error);
+}
+
+std::vector<LobjSPtr> seqToVector(LobjSPtr seq, const char *error) {
+	if (seq->typep<Vector>())
+		return seq->getAs<Vector>().elements;
+	std::vector<LobjSPtr> elements;
+	LobjSPtr head;
+	while (seqNext(seq, head, error))
+		elements.push_back(head);
+	return elements;
+}
+
+size_t hashBytes(const void *p, size_t n) {
+	const uint8_t *b = static_cast<const uint8_t*>(p);
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; ++i)
+		h = (h ^ b[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+size_t hashMix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+size_t hashObject(Lobj *obj, bool structural) {
+	if (obj->typep<Int>())
+		return hashMix(obj->getAs<Int>().value);
+	if (obj->typep<Bignum>())
+		return hashMix(obj->getAs<Bignum>().value.hash());
+	if (obj->typep<Float>()) {
+		double value = obj->getAs<Float>().value;
+		uint64_t bits;
+		if (value == 0) value = 0;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return hashMix(bits ^ 0x5851f42d4c957f2dULL);
+	}
+	if (obj->typep<String>())
+		return hashMix(hashBytes(obj->getAs<String>().data(), obj->getAs<String>().length));
+	if (structural) {
+		if (obj->typep<Cons>()) {
+			size_t h = 0x2545f4914f6cdd1dULL;
+			for (; obj->typep<Cons>(); obj = obj->getAs<Cons>().cdrPtr())
+				h = hashMix(h + hashObject(obj->getAs<Cons>().car.get(), true));
+			return obj->isNil() ? h : hashMix(h + hashObject(obj, true));
+		}
+		if (obj->typep<Vector>()) {
+			size_t h = 0x6a09e667f3bcc909ULL;
+			for (LobjSPtr &x : obj->getAs<Vector>().elements)
+				h = hashMix(h + hashObject(x.get(), true));
+			return h;
+		}
+		if (obj->typep<IntVector>()) {
+			size_t h = 0xbb67ae8584caa73bULL;
+			for (int64_t x : obj->getAs<IntVector>().elements)
+				h = hashMix(h + x);
+			return h;
+		}
+		if (obj->typep<ByteVector>()) {
+			std::vector<uint8_t> &e = obj->getAs<ByteVector>().elements;
+			return hashMix(hashBytes(e.data(), e.size()));
+		}
+	}
+	if (obj->typep<PVector>()) {
+		PVector &v = obj->getAs<PVector>();
+		if (v.hashCache == 0) {
+			size_t h = 0x3c6ef372fe94f82bULL;
+			for (size_t i = 0; i < v.value.size(); ++i)
+				h = hashMix(h + hashObject(v.value[i].get(), true));
+			v.hashCache = h | 1;
+		}
+		return v.hashCache;
+	}
+	if (obj->typep<PMap>()) {
+		PMap &m = obj->getAs<PMap>();
+		if (m.hashCache == 0) {
+			// Order-independent, since equal maps may differ in insertion history.
+			size_t h = 0xa54ff53a5f1d36f1ULL;
+			m.value.forEach([&h](const LobjSPtr &key, const LobjSPtr &value) {
+					h += hashMix(hashObject(key.get(), true) * 31 + hashObject(value.get(), true));
+				});
+			m.hashCache = h | 1;
+		}
+		return m.hashCache;
+	}
+	return hashMix(reinterpret_cast<uintptr_t>(obj));
+}
+
+// Structural equality: `eq?` on atoms, element by element on lists and vectors.
+bool equalObjects(Lobj *a, Lobj *b) {
+	while (1) {
+		if (a->eq(b))
+			return true;
+		if (a->typep<Cons>() && b->typep<Cons>()) {
+			if (!equalObjects(a->getAs<Cons>().car.get(), b->getAs<Cons>().car.get()))
+				return false;
+			a = a->getAs<Cons>().cdrPtr();
+			b = b->getAs<Cons>().cdrPtr();
+			continue;
+		}
+		if (typeid(*a) != typeid(*b))
+			return false;
+		if (a->typep<IntVector>())
+			return a->getAs<IntVector>().elements == b->getAs<IntVector>().elements;
+		if (a->typep<ByteVector>())
+			return a->getAs<ByteVector>().elements == b->getAs<ByteVector>().elements;
+		if (a->typep<Vector>()) {
+			std::vector<LobjSPtr> &x = a->getAs<Vector>().elements, &y = b->getAs<Vector>().elements;
+			if (x.size() != y.size())
+				return false;
+			for (size_t i = 0; i < x.size(); ++i) {
+				if (!equalObjects(x[i].get(), y[i].get()))
+					return false;
+			}
+			return true;
+		}
+		return false;
+	}
+}
+
+bool PVector::eq(Lobj *obj) const {
+	if (obj == this)
+		return true;
+	if (!obj->typep<PVector>() || obj->getAs<PVector>().value.size() != value.size())
+		return false;
+	const LobjPVector &other = obj->getAs<PVector>().value;
+	for (size_t i = 0; i < value.size(); ++i) {
+		if (!equalObjects(value[i].get(), other[i].get()))
+			return false;
+	}
+	return true;
+}
+
+bool PMap::eq(Lobj *obj) const {
+	if (obj == this)
+		return true;
+	if (!obj->typep<PMap>() || obj->getAs<PMap>().value.size() != value.size())
+		return false;
+	const LobjPMap &other = obj->getAs<PMap>().value;
+	bool equal = true;
+	value.forEach([&other, &equal](const LobjSPtr &key, const LobjSPtr &value) {
+			const LobjSPtr *found = other.find(key);
+			if (equal && (found == nullptr || !equalObjects(value.get(), found->get())))
+				equal = false;
+		});
+	return equal;
+}
+
+// Trie nodes are shared between versions, so only the element slots are
+// counted, once for every version that holds them.
+size_t PVector::size() const {
+	return sizeof(*this) + value.size() * sizeof(LobjSPtr);
+}
+
+void PVector::forEachRef(HeapWalker &walker) {
+	for (size_t i = 0; i < value.size(); ++i)
+		walker.ref(value[i]);
+}
+
+size_t PMap::size() const {
+	return sizeof(*this) + value.size() * 2 * sizeof(LobjSPtr);
+}
+
+void PMap::forEachRef(HeapWalker &walker) {
+	value.forEach([&walker](const LobjSPtr &key, const LobjSPtr &value) {
+			walker.ref(key);
+			walker.ref(value);
+		});
+}
+
+size_t TransientVector::size() const {
+	return sizeof(*this) + value.size() * sizeof(LobjSPtr);
+}
+
+void TransientVector::forEachRef(HeapWalker &walker) {
+	for (size_t i = 0; i < value.size(); ++i)
+		walker.ref(value[i]);
+}
+
+size_t TransientMap::size() const {
+	return sizeof(*this) + value.size() * 2 * sizeof(LobjSPtr);
+}
+
+void TransientMap::forEachRef(HeapWalker &walker) {
+	value.forEach([&walker](const LobjSPtr &key, const LobjSPtr &value) {
+			walker.ref(key);
+			walker.ref(value);
+		});
+}
+
+LobjPVector &pvectorOf(Lobj *obj, const char *error) {
+	if (obj->typep<PVector>())
+		return obj->getAs<PVector>().value;
+	if (obj->typep<TransientVector>() && !obj->getAs<TransientVector>().sealed)
+		return obj->getAs<TransientVector>().value;
+	throw error;
+}
+
+LobjPMap &pmapOf(Lobj *obj, const char *error) {
+	if (obj->typep<PMap>())
+		return obj->getAs<PMap>().value;
+	if (obj->typep<TransientMap>() && !obj->getAs<TransientMap>().sealed)
+		return obj->getAs<TransientMap>().value;
+	throw error;
+}
+
+LobjPMap emptyPMap() {
+	return LobjPMap(LobjHash{true}, LobjEqual{true});
+}
+
+size_t LobjHash::operator()(const LobjSPtr &obj) const {
+	return hashObject(obj.get(), structural);
+}
+
+bool LobjEqual::operator()(const LobjSPtr &a, const LobjSPtr &b) const {
+	return structural ? equalObjects(a.get(), b.get()) : a->eq(b.get());
+}
+
+size_t ArgsHash::operator()(const std::vector<LobjSPtr> &args) const {
+	size_t h = 0x510e527fade682d1ULL;
+	for (const LobjSPtr &x : args)
+		h = hashMix(h + hashObject(x.get(), true));
+	return h;
+}
+
+bool ArgsEqual::operator()(const std::vector<LobjSPtr> &a, const std::vector<LobjSPtr> &b) const {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (!equalObjects(a[i].get(), b[i].get()))
+			return false;
+	}
+	return true;
+}
+
+size_t ConstantPool::BufferHash::operator()(const Buffer &buffer) const {
+	return hashBytes(buffer->data(), buffer->size());
+}
+
+bool ConstantPool::BufferEqual::operator()(const Buffer &a, const Buffer &b) const {
+	return *a == *b;
+}
+
+size_t ConstantPool::KeyHash::operator()(const std::vector<LobjSPtr> &key) const {
+	size_t h = 0x9b05688c2b3e6c1fULL;
+	for (const LobjSPtr &x : key)
+		h = hashMix(h + (x->typep<Cons>() ? hashMix(reinterpret_cast<uintptr_t>(x.get())) : hashObject(x.get(), false)));
+	return h;
+}
+
+// Floats are compared bit for bit: 0.0 and -0.0 are eq? but must not be
+// merged into one constant.
+bool sameAtom(Lobj *a, Lobj *b) {
+	if (a->typep<Float>())
+		return b->typep<Float>() &&
+			std::memcmp(&a->getAs<Float>().value, &b->getAs<Float>().value, sizeof(double)) == 0;
+	return a->eq(b);
+}
+
+size_t ConstantPool::CellHash::operator()(const Lobj *cell) const {
+	return hashMix(reinterpret_cast<uintptr_t>(cell));
+}
+
+bool ConstantPool::KeyEqual::operator()(const std::vector<LobjSPtr> &a, const std::vector<LobjSPtr> &b) const {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (a[i] != b[i] && (a[i]->typep<Cons>() || !sameAtom(a[i].get(), b[i].get())))
+			return false;
+	}
+	return true;
+}
+
+LobjSPtr ConstantPool::string(std::string &&value) {
+	std::lock_guard<std::mutex> lock(mutex);
+	// Aliases `value` without owning it, to look it up without a copy.
+	LobjWPtr *found = strings.find(Buffer(Buffer(), &value));
+	LobjSPtr result = found != nullptr ? found->lock() : nullptr;
+	if (result == nullptr) {
+		result = newObj<String>(std::move(value));
+		strings.insert(result->getAs<String>().buffer, result);
+		sweepIfFull();
+	}
+	return result;
+}
+
+LobjSPtr ConstantPool::quoted(const LobjSPtr &obj) {
+	if (!obj->typep<Cons>())
+		return obj;
+	std::lock_guard<std::mutex> lock(mutex);
+	LobjSPtr result = pool(obj);
+	sweepIfFull();
+	return result;
+}
+
+LobjSPtr ConstantPool::pool(const LobjSPtr &list) {
+	std::vector<LobjSPtr> key;
+	bool changed = false;
+	LobjSPtr p = list;
+	for (; p->typep<Cons>(); p = cdrOf(p)) {
+		const LobjSPtr &car = p->getAs<Cons>().car;
+		key.push_back(car->typep<Cons>() ? pool(car) : car);
+		changed |= key.back() != car;
+	}
+	key.push_back(p);
+	LobjWPtr *found = lists.find(key);
+	LobjSPtr result = found != nullptr ? found->lock() : nullptr;
+	if (result != nullptr)
+		return result;
+	result = list;
+	if (changed)
+		result = makeList(std::vector<LobjSPtr>(key.begin(), key.end() - 1), p);
+	lists.insert(key, result);
+	for (LobjSPtr q = result; q->typep<Cons>(); q = cdrOf(q))
+		cells.insert(q.get(), q);
+	return result;
+}
+
+bool ConstantPool::isConstant(const Lobj *cell) {
+	std::lock_guard<std::mutex> lock(mutex);
+	LobjWPtr *found = cells.find(cell);
+	return found != nullptr && !found->expired();
+}
+
+void ConstantPool::sweepIfFull() {
+	if (strings.size() + lists.size() < sweepAt)
+		return;
+	std::vector<Buffer> deadStrings;
+	strings.forEach([&deadStrings](const Buffer &key, LobjWPtr &value) {
+			if (value.expired()) deadStrings.push_back(key);
+		});
+	for (const Buffer &key : deadStrings)
+		strings.erase(key);
+	std::vector<std::vector<LobjSPtr> > deadLists;
+	lists.forEach([&deadLists](const std::vector<LobjSPtr> &key, LobjWPtr &value) {
+			if (value.expired()) deadLists.push_back(key);
+		});
+	for (const std::vector<LobjSPtr> &key : deadLists)
+		lists.erase(key);
+	std::vector<const Lobj *> deadCells;
+	cells.forEach([&deadCells](const Lobj *key, LobjWPtr &value) {
+			if (value.expired()) deadCells.push_back(key);
+		});
+	for (const Lobj *key : deadCells)
+		cells.erase(key);
+	sweepAt = std::max<size_t>(1024, 2 * (strings.size() + lists.size()));
+}
+
+LobjSPtr MemoProc::call(Env &env, std::vector<LobjSPtr> &args) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t *slot = index.find(args);
+		if (slot != nullptr) {
+			Entry &entry = entries[*slot];
+			entry.referenced = true;
+			++hits;
+			return entry.value;
+		}
+		++misses;
+	}
+	// Builtins may reuse their argument vector, so keep the key apart.
+	std::vector<LobjSPtr> key(args);
+	LobjSPtr value = env.apply(function, args);
+	std::lock_guard<std::mutex> lock(mutex);
+	// A call for the same arguments may have finished first.
+	if (index.find(key) != nullptr)
+		return value;
+	size_t slot;
+	if (entries.size() < capacity) {
+		chargeBytes(sizeof(Entry) + key.size() * sizeof(LobjSPtr));
+		slot = entries.size();
+		entries.push_back(Entry{key, value, false});
+	} else {
+		while (entries[hand].referenced) {
+			entries[hand].referenced = false;
+			hand = (hand + 1) % capacity;
+		}
+		slot = hand;
+		hand = (hand + 1) % capacity;
+		index.erase(entries[slot].args);
+		entries[slot] = Entry{key, value, false};
+	}
+	index.insert(key, slot);
+	return value;
+}
+
+size_t MemoProc::size() const {
+	size_t n = sizeof(*this) + entries.capacity() * sizeof(Entry) + index.memoryUsage();
+	for (const Entry &entry : entries)
+		n += entry.args.capacity() * sizeof(LobjSPtr);
+	return n;
+}
+
+void MemoProc::forEachRef(HeapWalker &walker) {
+	std::lock_guard<std::mutex> lock(mutex);
+	walker.ref(function);
+	for (Entry &entry : entries) {
+		for (LobjSPtr &x : entry.args)
+			walker.ref(x);
+		walker.ref(entry.value);
+	}
+}
+
+void MemoProc::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	index.clear();
+	hand = 0;
+	hits = 0;
+	misses = 0;
+}
+
+LobjSPtr evalListElements(EnvSPtr env, LobjSPtr objPtr) {
+	std::vector<LobjSPtr> elements;
+	for (; typeid(*objPtr) == typeid(Cons); objPtr = cdrOf(objPtr))
+		elements.push_back(env->eval(objPtr->getAs<Cons>().car));
+	return makeList(elements, objPtr);
+}
+
+LobjSPtr vectorToList(std::vector<LobjSPtr> &v) {
+	return makeList(v, nil());
+}
+
+EnvSPtr makeEnvForMacro(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
+	EnvSPtr env = outerEnv->makeInnerEnv(procEnv);
+	if (!isProperList(args.get()))
+		throw "bad macro apply";
+	while (prms->typep<Cons>() && args->typep<Cons>()) {
+		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
+		env->bind(args->getAs<Cons>().car, symbol);
+		prms = cdrOf(prms);
+		args = cdrOf(args);
+	}
+	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
+		env->bind(args, &prms->getAs<Symbol>());
+	}
+	if (tail && !outerEnv->isClosed()) {
+		outerEnv->merge(env);
+		env = outerEnv;
+	}
+	return env;
+}
+/*
+EnvSPtr makeEnvForApply(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
+	if (!isProperList(args.get()))
+		throw "bad apply";
+	int prmsLength = listLength(prms.get());
+	int argsLength = listLength(args.get());
+	if (argsLength < prmsLength) throw "arguments is fewer";
+	std::vector<LobjSPtr> evaledArgs(prmsLength);
+	for (int i = 0; i < prmsLength; ++i) {
+		evaledArgs[i] = outerEnv->eval(args->getAs<Cons>().car);
+		args = cdrOf(args);
+	}
+	LobjSPtr argsRest = evalListElements(outerEnv, args);
+	EnvSPtr env;
+	if (tail && !outerEnv->isClosed()) {
+		env = outerEnv;
+		env->setLexEnv(procEnv);
+	} else {
+		env = outerEnv->makeInnerEnv(procEnv);
+	}
+	for (auto &evaledArg : evaledArgs) {
+		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
+		env->bind(evaledArg, symbol);
+		prms = cdrOf(prms);
+	}
+	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
+		env->bind(argsRest, &prms->getAs<Symbol>());
+	}
+	return env;
+}//*/
+//*
+EnvSPtr makeEnvForApply(EnvSPtr outerEnv, EnvSPtr procEnv, LobjSPtr prms, LobjSPtr args, bool tail = false) {
+	EnvSPtr env = outerEnv->makeInnerEnv(procEnv);
+	if (!isProperList(args.get()))
+		throw "bad apply";
+	while (prms->typep<Cons>() && args->typep<Cons>()) {
+		Symbol *symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
+		env->bind(outerEnv->eval(args->getAs<Cons>().car), symbol);
+		prms = cdrOf(prms);
+		args = cdrOf(args);
+	}
+	if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
+		LobjSPtr rest = evalListElements(outerEnv, args);
+		env->bind(rest, &prms->getAs<Symbol>());
+	}
+	if (tail && !outerEnv->isClosed()) {
+		outerEnv->merge(env);
+		env = outerEnv;
+	}
+	return env;
+}//*/
+
+// The table handed to native extensions; see extension.hpp.
+LispExtensionApi makeExtensionApi() {
+	LispExtensionApi api;
+	api.version = LISP_EXTENSION_API_VERSION;
+	api.defineBuiltin = [](const char *name, int minArgs, int maxArgs, BuiltinFunction function) {
+		currentInterpreter->rootEnv->bind(newObj<BuiltinProc>(function, name, minArgs, maxArgs),
+			&intern(name)->getAs<Symbol>());
+	};
+	api.intern = [](const char *name) {
+		return intern(name);
+	};
+	api.makeInt = [](int64_t value) -> LobjSPtr {
+		return makeInt(value);
+	};
+	api.makeString = [](const char *data, size_t length) -> LobjSPtr {
+		return newObj<String>(std::string(data, length));
+	};
+	api.makeCons = [](const LobjSPtr &car, const LobjSPtr &cdr) -> LobjSPtr {
+		return newObj<Cons>(car, cdr);
+	};
+	api.toInt64 = [](const LobjSPtr &obj, int64_t &value) {
+		if (!obj->typep<Int>()) return false;
+		value = obj->getAs<Int>().value;
+		return true;
+	};
+	api.toString = [](const LobjSPtr &obj, const char *&data, size_t &length) {
+		if (!obj->typep<String>()) return false;
+		data = obj->getAs<String>().data();
+		length = obj->getAs<String>().length;
+		return true;
+	};
+	api.toCons = [](const LobjSPtr &obj, LobjSPtr &car, LobjSPtr &cdr) {
+		if (!obj->typep<Cons>()) return false;
+		car = obj->getAs<Cons>().car;
+		cdr = cdrOf(obj);
+		return true;
+	};
+	api.isNil = [](const LobjSPtr &obj) {
+		return obj->isNil();
+	};
+	api.apply = [](Env &env, const LobjSPtr &function, std::vector<LobjSPtr> &args) {
+		return env.apply(function, args);
+	};
+	return api;
+}
+
+// Extensions stay loaded for the life of the process: the builtins they
+// register may be referenced from anywhere.
+bool loadExtension(const std::string &path, std::string &error) {
+	void *handle = ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (handle == nullptr) {
+		error = ::dlerror();
+		return false;
+	}
+	LispExtensionInit init = reinterpret_cast<LispExtensionInit>(::dlsym(handle, LISP_EXTENSION_INIT_SYMBOL));
+	if (init == nullptr) {
+		error = path + ": no " LISP_EXTENSION_INIT_SYMBOL;
+		return false;
+	}
+	static const LispExtensionApi api = makeExtensionApi();
+	if (init(&api) != 0) {
+		error = path + ": initialization failed";
+		return false;
+	}
+	return true;
+}
+
+
+Env::Env()
+	: global(true) {
+	LobjSPtr obj;
+	BuiltinProc *bfunc;
+
+	obj = intern("t");
+	bind(obj, &obj->getAs<Symbol>());
+
+	obj = nil();
+	bind(obj, &obj->getAs<Symbol>());
+
+	obj = intern("eq?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0) throw "bad arguments for function 'eq?'";
+			for (int i = 0; i < args.size() - 1; ++i) {
+				if (!args[i]->eq(args[i+1].get()))
+					return nil();
+			}
+			return boolToLobj(true);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("nil?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(args[0]->isNil());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("cons?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(typeid(*args[0]) == typeid(Cons));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("list?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(typeid(*args[0]) == typeid(Cons) || args[0]->isNil());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("symbol?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(typeid(*args[0]) == typeid(Symbol));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("int?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(isInteger(args[0].get()));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("float?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'float?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Float));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("number?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'number?'";
+			return boolToLobj(isNumber(args[0].get()));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(typeid(*args[0]) == typeid(String));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("proc?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'nil'";
+			return boolToLobj(isCallable(args[0].get()));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("+");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			int64_t value = 0, r;
+			size_t i = 0;
+			for (; i < args.size(); ++i) {
+				Lobj *o = args[i].get();
+				if (!o->typep<Int>() || __builtin_add_overflow(value, o->getAs<Int>().value, &r)) break;
+				value = r;
+			}
+			LobjSPtr acc = makeInt(value);
+			for (; i < args.size(); ++i)
+				acc = numArith('+', acc.get(), args[i].get(), "bad arguments for function '+'");
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("-");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0 || !isNumber(args[0].get()))
+				throw "bad arguments for function '-'";
+			if (args.size() == 1) {
+				Int zero(0);
+				return numArith('-', &zero, args[0].get(), "bad arguments for function '-'");
+			}
+			LobjSPtr acc = args[0];
+			size_t i = 1;
+			if (acc->typep<Int>()) {
+				int64_t value = acc->getAs<Int>().value, r;
+				for (; i < args.size(); ++i) {
+					Lobj *o = args[i].get();
+					if (!o->typep<Int>() || __builtin_sub_overflow(value, o->getAs<Int>().value, &r)) break;
+					value = r;
+				}
+				acc = makeInt(value);
+			}
+			for (; i < args.size(); ++i)
+				acc = numArith('-', acc.get(), args[i].get(), "bad arguments for function '-'");
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("*");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			int64_t value = 1, r;
+			size_t i = 0;
+			for (; i < args.size(); ++i) {
+				Lobj *o = args[i].get();
+				if (!o->typep<Int>() || __builtin_mul_overflow(value, o->getAs<Int>().value, &r)) break;
+				value = r;
+			}
+			LobjSPtr acc = makeInt(value);
+			for (; i < args.size(); ++i)
+				acc = numArith('*', acc.get(), args[i].get(), "bad arguments for function '*'");
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("/");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0 || !isNumber(args[0].get()))
+				throw "bad arguments for function '/'";
+			LobjSPtr acc = args[0];
+			for (size_t i = 1; i < args.size(); ++i)
+				acc = numArith('/', acc.get(), args[i].get(), "bad arguments for function '/'");
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("mod");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2)
+				throw "bad arguments for function 'mod'";
+			return numArith('%', args[0].get(), args[1].get(), "bad arguments for function 'mod'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("=");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0) throw "bad arguments for function '='";
+			for (LobjSPtr &objPtr : args) {
+				if (!isNumber(objPtr.get())) throw "bad arguments for function '='";
+			}
+			for (size_t i = 0; i < args.size() - 1; ++i) {
+				if (numCompare(args[i].get(), args[i+1].get()) != 0)
+					return nil();
+			}
+			return boolToLobj(true);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("<");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0) throw "bad arguments for function '<'";
+			for (LobjSPtr &objPtr : args) {
+				if (!isNumber(objPtr.get())) throw "bad arguments for function '<'";
+			}
+			for (size_t i = 0; i < args.size() - 1; ++i) {
+				if (numCompare(args[i].get(), args[i+1].get()) != -1)
+					return nil();
+			}
+			return boolToLobj(true);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("float");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isNumber(args[0].get()))
+				throw "bad arguments for function 'float'";
+			return newObj<Float>(toDouble(args[0].get()));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("truncate");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isNumber(args[0].get()))
+				throw "bad arguments for function 'truncate'";
+			if (!args[0]->typep<Float>())
+				return args[0];
+			double value = args[0]->getAs<Float>().value;
+			if (std::isnan(value) || std::isinf(value))
+				throw "bad arguments for function 'truncate'";
+			return normalizeBigInt(BigInt::fromDouble(value));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("make-vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || 2 < args.size())
+				throw "bad arguments for function 'make-vector'";
+			size_t n = toIndex(args[0].get(), SIZE_MAX, "bad arguments for function 'make-vector'");
+			return newObj<Vector>(n, args.size() == 2 ? args[1] : nil());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			auto v = newObj<Vector>(0, nullptr);
+			v->elements = args;
+			return v;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("make-int-vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || 2 < args.size())
+				throw "bad arguments for function 'make-int-vector'";
+			size_t n = toIndex(args[0].get(), SIZE_MAX, "bad arguments for function 'make-int-vector'");
+			int64_t fill = args.size() == 2 ? toInt64Element(args[1].get(), "bad arguments for function 'make-int-vector'") : 0;
+			return newObj<IntVector>(n, fill);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("int-vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			auto v = newObj<IntVector>(args.size());
+			for (size_t i = 0; i < args.size(); ++i)
+				v->elements[i] = toInt64Element(args[i].get(), "bad arguments for function 'int-vector'");
+			return v;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("make-byte-vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || 2 < args.size())
+				throw "bad arguments for function 'make-byte-vector'";
+			size_t n = toIndex(args[0].get(), SIZE_MAX, "bad arguments for function 'make-byte-vector'");
+			uint8_t fill = args.size() == 2 ? toByteElement(args[1].get(), "bad arguments for function 'make-byte-vector'") : 0;
+			return newObj<ByteVector>(n, fill);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("byte-vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			auto v = newObj<ByteVector>(args.size());
+			for (size_t i = 0; i < args.size(); ++i)
+				v->elements[i] = toByteElement(args[i].get(), "bad arguments for function 'byte-vector'");
+			return v;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'vector?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Vector));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("int-vector?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'int-vector?'";
+			return boolToLobj(typeid(*args[0]) == typeid(IntVector));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("byte-vector?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'byte-vector?'";
+			return boolToLobj(typeid(*args[0]) == typeid(ByteVector));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-length");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-length'";
+			return makeInt(vectorLength(args[0].get()));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-ref");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() != 2 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-ref'";
+			Lobj *v = args[0].get();
+			size_t i = toIndex(args[1].get(), vectorLength(v), "bad arguments for function 'vector-ref'");
+			if (i == vectorLength(v)) throw "index out of range";
+			if (v->typep<Vector>()) return v->getAs<Vector>().elements[i];
+			if (v->typep<IntVector>()) return makeInt(v->getAs<IntVector>().elements[i]);
+			return makeInt(v->getAs<ByteVector>().elements[i]);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-set!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 3 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-set!'";
+			Lobj *v = args[0].get();
+			size_t i = toIndex(args[1].get(), vectorLength(v), "bad arguments for function 'vector-set!'");
+			if (i == vectorLength(v)) throw "index out of range";
+			if (v->typep<Vector>())
+				v->getAs<Vector>().elements[i] = args[2];
+			else if (v->typep<IntVector>())
+				v->getAs<IntVector>().elements[i] = toInt64Element(args[2].get(), "bad arguments for function 'vector-set!'");
+			else
+				v->getAs<ByteVector>().elements[i] = toByteElement(args[2].get(), "bad arguments for function 'vector-set!'");
+			return args[2];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector->list");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector->list'";
+			Lobj *v = args[0].get();
+			if (v->typep<Vector>())
+				return vectorToList(v->getAs<Vector>().elements);
+			std::vector<LobjSPtr> elements(vectorLength(v));
+			for (size_t i = 0; i < elements.size(); ++i) {
+				elements[i] = makeInt(v->typep<IntVector>() ?
+																						v->getAs<IntVector>().elements[i] : v->getAs<ByteVector>().elements[i]);
+			}
+			return vectorToList(elements);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("list->vector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isProperList(args[0].get()))
+				throw "bad arguments for function 'list->vector'";
+			auto v = newObj<Vector>(0, nullptr);
+			for (Lobj *o = args[0].get(); o->typep<Cons>(); o = o->getAs<Cons>().cdrPtr())
+				v->elements.push_back(o->getAs<Cons>().car);
+			return v;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-sum");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-sum'";
+			if (args[0]->typep<IntVector>()) {
+				std::vector<int64_t> &v = args[0]->getAs<IntVector>().elements;
+				if (v.empty()) return makeInt(0);
+				int64_t sum, min, max;
+				simd::kernels().reduceInt64(v.data(), v.size(), sum, min, max);
+				// The wrapping sum is exact when no partial sum can leave the int64 range.
+				uint64_t bound = std::max(min < 0 ? ~static_cast<uint64_t>(min) + 1 : min,
+																	max < 0 ? ~static_cast<uint64_t>(max) + 1 : max);
+				if (bound == 0 || v.size() <= INT64_MAX / bound)
+					return makeInt(sum);
+				__int128 exact = 0;
+				for (int64_t x : v) exact += x;
+				return int128ToLobj(exact);
+			}
+			if (args[0]->typep<ByteVector>()) {
+				std::vector<uint8_t> &v = args[0]->getAs<ByteVector>().elements;
+				return makeInt(simd::kernels().sumBytes(v.data(), v.size()));
+			}
+			LobjSPtr acc = makeInt(0);
+			for (LobjSPtr &x : args[0]->getAs<Vector>().elements)
+				acc = numArith('+', acc.get(), x.get(), "bad arguments for function 'vector-sum'");
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-min");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			return vectorExtreme(-1, args, "bad arguments for function 'vector-min'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-max");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			return vectorExtreme(1, args, "bad arguments for function 'vector-max'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-add");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			return vectorArith('+', args, "bad arguments for function 'vector-add'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-sub");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			return vectorArith('-', args, "bad arguments for function 'vector-sub'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-mul");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			return vectorArith('*', args, "bad arguments for function 'vector-mul'");
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-fill!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-fill!'";
+			Lobj *v = args[0].get();
+			if (v->typep<IntVector>()) {
+				std::vector<int64_t> &e = v->getAs<IntVector>().elements;
+				simd::kernels().fillInt64(e.data(), e.size(), toInt64Element(args[1].get(), "bad arguments for function 'vector-fill!'"));
+			} else if (v->typep<ByteVector>()) {
+				std::vector<uint8_t> &e = v->getAs<ByteVector>().elements;
+				std::memset(e.data(), toByteElement(args[1].get(), "bad arguments for function 'vector-fill!'"), e.size());
+			} else {
+				std::vector<LobjSPtr> &e = v->getAs<Vector>().elements;
+				std::fill(e.begin(), e.end(), args[1]);
+			}
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-copy!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'vector-copy!'";
+			if (args.size() < 3 || 5 < args.size() || !isVector(args[0].get()) ||
+					typeid(*args[0]) != typeid(*args[2]))
+				throw error;
+			Lobj *dst = args[0].get(), *src = args[2].get();
+			size_t srcLength = vectorLength(src);
+			size_t at = toIndex(args[1].get(), vectorLength(dst), error);
+			size_t start = args.size() > 3 ? toIndex(args[3].get(), srcLength, error) : 0;
+			size_t end = args.size() > 4 ? toIndex(args[4].get(), srcLength, error) : srcLength;
+			if (end < start || vectorLength(dst) - at < end - start) throw "index out of range";
+			if (dst->typep<IntVector>()) {
+				std::memmove(dst->getAs<IntVector>().elements.data() + at,
+										 src->getAs<IntVector>().elements.data() + start, (end - start) * sizeof(int64_t));
+			} else if (dst->typep<ByteVector>()) {
+				std::memmove(dst->getAs<ByteVector>().elements.data() + at,
+										 src->getAs<ByteVector>().elements.data() + start, end - start);
+			} else {
+				std::vector<LobjSPtr> &d = dst->getAs<Vector>().elements, &s = src->getAs<Vector>().elements;
+				if (&d == &s && start < at)
+					std::copy_backward(s.begin() + start, s.begin() + end, d.begin() + at + (end - start));
+				else
+					std::copy(s.begin() + start, s.begin() + end, d.begin() + at);
+			}
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("vector-index");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !isVector(args[0].get()))
+				throw "bad arguments for function 'vector-index'";
+			Lobj *v = args[0].get(), *x = args[1].get();
+			size_t n = vectorLength(v), i = n;
+			if (v->typep<IntVector>()) {
+				if (x->typep<Int>())
+					i = simd::kernels().findInt64(v->getAs<IntVector>().elements.data(), n, x->getAs<Int>().value);
+			} else if (v->typep<ByteVector>()) {
+				if (x->typep<Int>() && 0 <= x->getAs<Int>().value && x->getAs<Int>().value <= 255)
+					i = simd::findBytes(v->getAs<ByteVector>().elements.data(), n, x->getAs<Int>().value);
+			} else {
+				std::vector<LobjSPtr> &e = v->getAs<Vector>().elements;
+				for (i = 0; i < n && !e[i]->eq(x); ++i);
+			}
+			return i == n ? nil() : makeInt(i);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("equal?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() == 0) throw "bad arguments for function 'equal?'";
+			for (size_t i = 0; i < args.size() - 1; ++i) {
+				if (!equalObjects(args[i].get(), args[i+1].get()))
+					return nil();
+			}
+			return boolToLobj(true);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("make-hash-table");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() > 1)
+				throw "bad arguments for function 'make-hash-table'";
+			bool structural = true;
+			if (args.size() == 1) {
+				if (args[0] == env.resolve(&intern("eq?")->getAs<Symbol>()))
+					structural = false;
+				else if (args[0] != env.resolve(&intern("equal?")->getAs<Symbol>()))
+					throw "bad arguments for function 'make-hash-table'";
+			}
+			return newObj<HashTable>(structural);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-table?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'hash-table?'";
+			return boolToLobj(typeid(*args[0]) == typeid(HashTable));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-get");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 2 || 3 < args.size() || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-get'";
+			LobjSPtr *value = args[0]->getAs<HashTable>().map.find(args[1]);
+			if (value != nullptr) return *value;
+			return args.size() == 3 ? args[2] : nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-contains?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-contains?'";
+			return boolToLobj(args[0]->getAs<HashTable>().map.find(args[1]) != nullptr);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-set!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 3 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-set!'";
+			args[0]->getAs<HashTable>().map.insert(args[1], args[2]);
+			return args[2];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-remove!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-remove!'";
+			return boolToLobj(args[0]->getAs<HashTable>().map.erase(args[1]));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-count");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-count'";
+			return makeInt(args[0]->getAs<HashTable>().map.size());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-clear!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-clear!'";
+			args[0]->getAs<HashTable>().map.clear();
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-keys");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-keys'";
+			std::vector<LobjSPtr> keys;
+			args[0]->getAs<HashTable>().map.forEach([&keys](const LobjSPtr &key, LobjSPtr &value) {
+					keys.push_back(key);
+				});
+			return vectorToList(keys);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-values");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-values'";
+			std::vector<LobjSPtr> values;
+			args[0]->getAs<HashTable>().map.forEach([&values](const LobjSPtr &key, LobjSPtr &value) {
+					values.push_back(value);
+				});
+			return vectorToList(values);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash->list");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash->list'";
+			std::vector<LobjSPtr> entries;
+			args[0]->getAs<HashTable>().map.forEach([&entries](const LobjSPtr &key, LobjSPtr &value) {
+					entries.push_back(newObj<Cons>(key, value));
+				});
+			return vectorToList(entries);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("hash-for-each");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<HashTable>())
+				throw "bad arguments for function 'hash-for-each'";
+			// Snapshot first so the callback may update the table.
+			std::vector<std::pair<LobjSPtr, LobjSPtr> > entries;
+			args[0]->getAs<HashTable>().map.forEach([&entries](const LobjSPtr &key, LobjSPtr &value) {
+					entries.push_back(std::make_pair(key, value));
+				});
+			for (auto &entry : entries) {
+				std::vector<LobjSPtr> fargs = {entry.first, entry.second};
+				env.apply(args[1], fargs);
+			}
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("memoize");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			int64_t capacity = 4096;
+			if (args.size() < 1 || args.size() > 2 ||
+					!isCallable(args[0].get()) ||
+					(args.size() == 2 && (!toInt64(args[1], capacity) || capacity <= 0)))
+				throw "bad arguments for function 'memoize'";
+			return newObj<MemoProc>(args[0], capacity);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("memo-stats");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<MemoProc>())
+				throw "bad arguments for function 'memo-stats'";
+			MemoProc &memo = args[0]->getAs<MemoProc>();
+			std::lock_guard<std::mutex> lock(memo.mutex);
+			std::vector<LobjSPtr> stats = {
+				intern(":hits"), makeInt(memo.hits),
+				intern(":misses"), makeInt(memo.misses),
+				intern(":size"), makeInt(memo.entries.size()),
+				intern(":capacity"), makeInt(memo.capacity)
+			};
+			return vectorToList(stats);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("memo-clear!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<MemoProc>())
+				throw "bad arguments for function 'memo-clear!'";
+			args[0]->getAs<MemoProc>().clear();
+			return currentInterpreter->nilSymbol;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			LobjPVector v = LobjPVector().transient();
+			for (LobjSPtr &x : args)
+				v.pushBack(x);
+			return newObj<PVector>(v.persistent());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'pvector?'";
+			return boolToLobj(typeid(*args[0]) == typeid(PVector));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-length");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'pvector-length'";
+			return makeInt(pvectorOf(args[0].get(), "bad arguments for function 'pvector-length'").size());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-ref");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'pvector-ref'";
+			if (args.size() != 2) throw error;
+			LobjPVector &v = pvectorOf(args[0].get(), error);
+			size_t i = toIndex(args[1].get(), v.size(), error);
+			if (i == v.size()) throw "index out of range";
+			return v[i];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-conj");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || !args[0]->typep<PVector>())
+				throw "bad arguments for function 'pvector-conj'";
+			LobjPVector v = args[0]->getAs<PVector>().value;
+			for (size_t i = 1; i < args.size(); ++i)
+				v = v.conj(args[i]);
+			return newObj<PVector>(v);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-assoc");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'pvector-assoc'";
+			if (args.size() != 3 || !args[0]->typep<PVector>()) throw error;
+			LobjPVector &v = args[0]->getAs<PVector>().value;
+			size_t i = toIndex(args[1].get(), v.size(), error);
+			return newObj<PVector>(i == v.size() ? v.conj(args[2]) : v.assoc(i, args[2]));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-pop");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<PVector>() || args[0]->getAs<PVector>().value.size() == 0)
+				throw "bad arguments for function 'pvector-pop'";
+			return newObj<PVector>(args[0]->getAs<PVector>().value.pop());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector->list");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'pvector->list'";
+			LobjPVector &v = pvectorOf(args[0].get(), "bad arguments for function 'pvector->list'");
+			std::vector<LobjSPtr> elements(v.size());
+			for (size_t i = 0; i < v.size(); ++i)
+				elements[i] = v[i];
+			return vectorToList(elements);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-of");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() % 2 != 0)
+				throw "bad arguments for function 'pmap-of'";
+			LobjPMap m = emptyPMap().transient();
+			for (size_t i = 0; i < args.size(); i += 2)
+				m.set(args[i], args[i+1]);
+			return newObj<PMap>(m.persistent());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'pmap?'";
+			return boolToLobj(typeid(*args[0]) == typeid(PMap));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-count");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'pmap-count'";
+			return makeInt(pmapOf(args[0].get(), "bad arguments for function 'pmap-count'").size());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-get");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 2 || 3 < args.size())
+				throw "bad arguments for function 'pmap-get'";
+			const LobjSPtr *value = pmapOf(args[0].get(), "bad arguments for function 'pmap-get'").find(args[1]);
+			if (value != nullptr) return *value;
+			return args.size() == 3 ? args[2] : nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-contains?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2)
+				throw "bad arguments for function 'pmap-contains?'";
+			return boolToLobj(pmapOf(args[0].get(), "bad arguments for function 'pmap-contains?'").find(args[1]) != nullptr);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-assoc");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() % 2 != 1 || !args[0]->typep<PMap>())
+				throw "bad arguments for function 'pmap-assoc'";
+			LobjPMap m = args[0]->getAs<PMap>().value;
+			for (size_t i = 1; i < args.size(); i += 2)
+				m = m.assoc(args[i], args[i+1]);
+			return newObj<PMap>(m);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-dissoc");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || !args[0]->typep<PMap>())
+				throw "bad arguments for function 'pmap-dissoc'";
+			LobjPMap m = args[0]->getAs<PMap>().value;
+			for (size_t i = 1; i < args.size(); ++i)
+				m = m.dissoc(args[i]);
+			return newObj<PMap>(m);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap-keys");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'pmap-keys'";
+			std::vector<LobjSPtr> keys;
+			pmapOf(args[0].get(), "bad arguments for function 'pmap-keys'").forEach([&keys](const LobjSPtr &key, const LobjSPtr &value) {
+					keys.push_back(key);
+				});
+			return vectorToList(keys);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap->list");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'pmap->list'";
+			std::vector<LobjSPtr> entries;
+			pmapOf(args[0].get(), "bad arguments for function 'pmap->list'").forEach([&entries](const LobjSPtr &key, const LobjSPtr &value) {
+					entries.push_back(newObj<Cons>(key, value));
+				});
+			return vectorToList(entries);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("transient");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() != 1)
+				throw "bad arguments for function 'transient'";
+			if (args[0]->typep<PVector>())
+				return newObj<TransientVector>(args[0]->getAs<PVector>().value);
+			if (args[0]->typep<PMap>())
+				return newObj<TransientMap>(args[0]->getAs<PMap>().value);
+			throw "bad arguments for function 'transient'";
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("persistent!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			const char *error = "bad arguments for function 'persistent!'";
+			if (args.size() != 1) throw error;
+			if (args[0]->typep<TransientVector>()) {
+				LobjSPtr v = newObj<PVector>(pvectorOf(args[0].get(), error).persistent());
+				args[0]->getAs<TransientVector>().sealed = true;
+				return v;
+			}
+			LobjSPtr m = newObj<PMap>(pmapOf(args[0].get(), error).persistent());
+			if (!args[0]->typep<TransientMap>()) throw error;
+			args[0]->getAs<TransientMap>().sealed = true;
+			return m;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("conj!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || !args[0]->typep<TransientVector>())
+				throw "bad arguments for function 'conj!'";
+			LobjPVector &v = pvectorOf(args[0].get(), "bad arguments for function 'conj!'");
+			for (size_t i = 1; i < args.size(); ++i)
+				v.pushBack(args[i]);
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("assoc!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'assoc!'";
+			if (args.size() != 3) throw error;
+			if (args[0]->typep<TransientVector>()) {
+				LobjPVector &v = pvectorOf(args[0].get(), error);
+				size_t i = toIndex(args[1].get(), v.size(), error);
+				if (i == v.size())
+					v.pushBack(args[2]);
+				else
+					v.set(i, args[2]);
+			} else {
+				if (!args[0]->typep<TransientMap>()) throw error;
+				pmapOf(args[0].get(), error).set(args[1], args[2]);
+			}
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("dissoc!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<TransientMap>())
+				throw "bad arguments for function 'dissoc!'";
+			pmapOf(args[0].get(), "bad arguments for function 'dissoc!'").erase(args[1]);
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pvector-pop!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<TransientVector>())
+				throw "bad arguments for function 'pvector-pop!'";
+			LobjPVector &v = pvectorOf(args[0].get(), "bad arguments for function 'pvector-pop!'");
+			if (v.size() == 0) throw "bad arguments for function 'pvector-pop!'";
+			v.popBack();
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("print");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			std::ostream &os = outputStream(currentInterpreter->currentOutputPort.get(), "bad output port");
+			for (LobjSPtr &objPtr : args) {
+				objPtr->print(os);
+			}
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("println");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			std::ostream &os = outputStream(currentInterpreter->currentOutputPort.get(), "bad output port");
+			for (LobjSPtr &objPtr : args) {
+				objPtr->print(os);
+				os << '\n';
+			}
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("print-to-string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() == 1 && args[0]->typep<String>())
+				return args[0];
+			std::string str;
+			appendPrinted(str, args, 0);
+			return newObj<String>(std::move(str));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-length");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<String>())
+				throw "bad arguments for function 'string-length'";
+			return makeInt(args[0]->getAs<String>().length);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-append");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			size_t length = 0, nonEmpty = 0;
+			LobjSPtr last;
+			for (LobjSPtr &x : args) {
+				if (!x->typep<String>())
+					throw "bad arguments for function 'string-append'";
+				if (x->getAs<String>().length != 0) {
+					length += x->getAs<String>().length;
+					last = x;
+					++nonEmpty;
+				}
+			}
+			if (nonEmpty == 1) return last;
+			std::string str;
+			str.reserve(length);
+			for (LobjSPtr &x : args)
+				str.append(x->getAs<String>().data(), x->getAs<String>().length);
+			return newObj<String>(std::move(str));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("substring");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'substring'";
+			if (args.size() < 2 || 3 < args.size() || !args[0]->typep<String>()) throw error;
+			String &str = args[0]->getAs<String>();
+			size_t start = toIndex(args[1].get(), str.length, error);
+			size_t end = args.size() == 3 ? toIndex(args[2].get(), str.length, error) : str.length;
+			if (end < start) throw "index out of range";
+			return substring(str, start, end);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-search");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			const char *error = "bad arguments for function 'string-search'";
+			if (args.size() < 2 || 3 < args.size() || !args[0]->typep<String>() || !args[1]->typep<String>())
+				throw error;
+			String &str = args[0]->getAs<String>();
+			size_t start = args.size() == 3 ? toIndex(args[2].get(), str.length, error) : 0;
+			size_t i = findString(str, args[1]->getAs<String>(), start);
+			return i == std::string::npos ? nil() : makeInt(i);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-split");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<String>() || !args[1]->typep<String>() ||
+					args[1]->getAs<String>().length == 0)
+				throw "bad arguments for function 'string-split'";
+			String &str = args[0]->getAs<String>(), &separator = args[1]->getAs<String>();
+			std::vector<LobjSPtr> fields;
+			size_t start = 0;
+			for (;;) {
+				size_t i = findString(str, separator, start);
+				if (i == std::string::npos) break;
+				fields.push_back(substring(str, start, i));
+				start = i + separator.length;
+			}
+			fields.push_back(substring(str, start, str.length));
+			return vectorToList(fields);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("make-string-builder");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 0)
+				throw "bad arguments for function 'make-string-builder'";
+			return newObj<StringBuilder>();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-builder-append!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || !args[0]->typep<StringBuilder>())
+				throw "bad arguments for function 'string-builder-append!'";
+			appendPrinted(args[0]->getAs<StringBuilder>().value, args, 1);
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-builder-length");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<StringBuilder>())
+				throw "bad arguments for function 'string-builder-length'";
+			return makeInt(args[0]->getAs<StringBuilder>().value.size());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("string-builder->string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<StringBuilder>())
+				throw "bad arguments for function 'string-builder->string'";
+			return newObj<String>(args[0]->getAs<StringBuilder>().value);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("input-port?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'input-port?'";
+			return boolToLobj(typeid(*args[0]) == typeid(InputPort) || typeid(*args[0]) == typeid(Socket));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("output-port?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'output-port?'";
+			return boolToLobj(typeid(*args[0]) == typeid(OutputPort) || typeid(*args[0]) == typeid(Socket));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("current-input-port");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 0) throw "bad arguments for function 'current-input-port'";
+			return currentInterpreter->stdinPort;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("current-output-port");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 0) throw "bad arguments for function 'current-output-port'";
+			return currentInterpreter->currentOutputPort;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("open-input-file");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<String>())
+				throw "bad arguments for function 'open-input-file'";
+			LobjSPtr port = openFilePort(args[0]->getAs<String>().str(), false);
+			if (port == nullptr) throw "cannot open file";
+			return port;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("open-output-file");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<String>())
+				throw "bad arguments for function 'open-output-file'";
+			LobjSPtr port = openFilePort(args[0]->getAs<String>().str(), true);
+			if (port == nullptr) throw "cannot open file";
+			return port;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("open-input-string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<String>())
+				throw "bad arguments for function 'open-input-string'";
+			String &str = args[0]->getAs<String>();
+			return newObj<InputPort>(std::make_shared<StringSource>(str.buffer, str.offset, str.length));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("open-output-string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 0)
+				throw "bad arguments for function 'open-output-string'";
+			return newObj<OutputPort>(std::make_shared<std::stringbuf>(std::ios::out));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("get-output-string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'get-output-string'";
+			outputStream(args[0].get(), "bad arguments for function 'get-output-string'");
+			std::stringbuf *buf = dynamic_cast<std::stringbuf*>(args[0]->getAs<OutputPort>().buf.get());
+			if (buf == nullptr)
+				throw "bad arguments for function 'get-output-string'";
+			return newObj<String>(buf->str());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("close-port");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'close-port'";
+			if (args[0]->typep<InputPort>())
+				args[0]->getAs<InputPort>().close();
+			else if (args[0]->typep<OutputPort>())
+				args[0]->getAs<OutputPort>().close();
+			else if (args[0]->typep<Socket>())
+				args[0]->getAs<Socket>().close();
+			else if (args[0]->typep<Listener>())
+				args[0]->getAs<Listener>().close();
+			else
+				throw "bad arguments for function 'close-port'";
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("flush");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() > 1)
+				throw "bad arguments for function 'flush'";
+			outputArg(args, 0, "bad arguments for function 'flush'").flush();
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("read-line");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() > 1)
+				throw "bad arguments for function 'read-line'";
+			std::string line;
+			if (!std::getline(inputArg(args, 0, "bad arguments for function 'read-line'"), line))
+				return nil();
+			return newObj<String>(std::move(line));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("read-bytes");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			const char *error = "bad arguments for function 'read-bytes'";
+			if (args.size() != 2 || !args[1]->typep<Int>() || args[1]->getAs<Int>().value < 0)
+				throw error;
+			std::istream &is = inputStream(args[0].get(), error);
+			size_t n = args[1]->getAs<Int>().value;
+			std::shared_ptr<ByteVector> bytes = newObj<ByteVector>(n);
+			std::streamsize got = is.rdbuf()->sgetn(reinterpret_cast<char*>(bytes->elements.data()), n);
+			if (got == 0 && n != 0) return nil();
+			bytes->elements.resize(got);
+			return bytes;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("write-string");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || 2 < args.size() || !args[0]->typep<String>())
+				throw "bad arguments for function 'write-string'";
+			String &str = args[0]->getAs<String>();
+			outputArg(args, 1, "bad arguments for function 'write-string'").write(str.data(), str.length);
+			return nil();
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("with-output-to-file");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<String>())
+				throw "bad arguments for function 'with-output-to-file'";
+			LobjSPtr port = openFilePort(args[0]->getAs<String>().str(), true);
+			if (port == nullptr) throw "cannot open file";
+			LobjSPtr result;
+			{
+				OutputRedirect redirect(port);
+				std::vector<LobjSPtr> noArgs;
+				result = env.apply(args[1], noArgs);
+			}
+			port->getAs<OutputPort>().close();
+			return result;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("force");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'force'";
+			if (args[0]->typep<Promise>())
+				return args[0]->getAs<Promise>().force();
+			if (args[0]->typep<LazySeq>())
+				return args[0]->getAs<LazySeq>().force();
+			return args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("promise?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'promise?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Promise));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("lazy-seq?");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1) throw "bad arguments for function 'lazy-seq?'";
+			return boolToLobj(typeid(*args[0]) == typeid(LazySeq));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("lazy-map");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2)
+				throw "bad arguments for function 'lazy-map'";
+			return lazyMap(std::move(args[0]), std::move(args[1]), env.makeInnerEnv());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("lazy-filter");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2)
+				throw "bad arguments for function 'lazy-filter'";
+			return lazyFilter(std::move(args[0]), std::move(args[1]), env.makeInnerEnv());
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("lazy-range");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() < 1 || 2 < args.size() || !args[0]->typep<Int>() ||
+					(args.size() == 2 && !args[1]->typep<Int>()))
+				throw "bad arguments for function 'lazy-range'";
+			int64_t end = args.size() == 2 ? args[1]->getAs<Int>().value : 0;
+			return lazyRange(args[0]->getAs<Int>().value, end, args.size() == 2);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("take");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<Int>())
+				throw "bad arguments for function 'take'";
+			return lazyTake(args[0]->getAs<Int>().value, std::move(args[1]));
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("drop");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || !args[0]->typep<Int>())
+				throw "bad arguments for function 'drop'";
+			int64_t n = args[0]->getAs<Int>().value;
+			LobjSPtr seq = std::move(args[1]);
+			return newObj<LazySeq>([n, seq]() mutable -> LobjSPtr {
+					LobjSPtr head;
+					for (int64_t i = 0; i < n && seqNext(seq, head, "bad arguments for function 'drop'"); ++i);
+					return seq->typep<LazySeq>() ? seq->getAs<LazySeq>().force() : seq;
+				});
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("fold");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 3)
+				throw "bad arguments for function 'fold'";
+			// Take the sequence out of args so consumed cells are freed as we go.
+			LobjSPtr func = std::move(args[0]), acc = std::move(args[1]), seq = std::move(args[2]);
+			LobjSPtr head;
+			std::vector<LobjSPtr> fargs(2);
+			while (seqNext(seq, head, "bad arguments for function 'fold'")) {
+				fargs[0] = std::move(acc);
+				fargs[1] = std::move(head);
+				acc = env.apply(func, fargs);
+			}
+			return acc;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-Env::Env() {
-	LobjSPtr obj;
-	BuiltinProc *bfunc;
+	obj = intern("lazy->list");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'lazy->list'";
+			LobjSPtr seq = std::move(args[0]), head;
+			std::vector<LobjSPtr> elements;
+			while (seqNext(seq, head, "bad arguments for function 'lazy->list'"))
+				elements.push_back(head);
+			return vectorToList(elements);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("t");
-	bind(obj, &obj->getAs<Symbol>());
+	obj = intern("port-lines");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<InputPort>())
+				throw "bad arguments for function 'port-lines'";
+			return portLines(args[0]);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("nil");
-	bind(obj, &obj->getAs<Symbol>());
+	obj = intern("touch");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1)
+				throw "bad arguments for function 'touch'";
+			return args[0]->typep<Future>() ? args[0]->getAs<Future>().touch() : args[0];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("eq?");
+	obj = intern("future?");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() == 0) throw "bad arguments for function 'eq?'";
-			for (int i = 0; i < args.size() - 1; ++i) {
-				if (!args[i]->eq(args[i+1].get()))
-					return intern("nil");
-			}
-			return intern("t");
+			if (args.size() != 1) throw "bad arguments for function 'future?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Future));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("nil?");
+	obj = intern("make-generator");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(args[0]->isNil());
+			if (args.size() != 1 || !isCallable(args[0].get()))
+				throw "bad arguments for function 'make-generator'";
+			return newObj<Generator>(args[0], env.makeInnerEnv());
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("cons?");
+	obj = intern("resume");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(Cons));
+			if (args.empty() || args.size() > 2 || !args[0]->typep<Generator>())
+				throw "bad arguments for function 'resume'";
+			LobjSPtr value = args.size() == 2 ? args[1] : nil();
+			args[0]->getAs<Generator>().resume(value);
+			return value;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("list?");
+	obj = intern("yield");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(Cons) || args[0]->isNil());
+			if (args.size() > 1)
+				throw "bad arguments for function 'yield'";
+			if (currentGenerator == nullptr)
+				throw "yield outside of generator";
+			return currentGenerator->yield(args.empty() ? nil() : args[0]);
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("symbol?");
+	obj = intern("throw");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() != 1 && args.size() != 2)
+				throw "bad arguments for function 'throw'";
+			pendingThrow.tag = args[0];
+			pendingThrow.value = args.size() == 2 ? args[1] : nil();
+			pendingThrow.active = true;
+			return nullptr;
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("error");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() == 0 || !args[0]->typep<String>())
+				throw "bad arguments for function 'error'";
+			std::vector<LobjSPtr> irritants(args.begin() + 1, args.end());
+			throw LispError{newObj<Condition>(intern("error"), args[0]->getAs<String>().str(), vectorToList(irritants))};
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("condition?");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(Symbol));
+			if (args.size() != 1) throw "bad arguments for function 'condition?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Condition));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("int?");
+	obj = intern("condition-kind");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(Int));
+			if (args.size() != 1 || !args[0]->typep<Condition>())
+				throw "bad arguments for function 'condition-kind'";
+			return args[0]->getAs<Condition>().kind;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("string?");
+	obj = intern("condition-message");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) -> LobjSPtr {
+			if (args.size() != 1 || !args[0]->typep<Condition>())
+				throw "bad arguments for function 'condition-message'";
+			return newObj<String>(args[0]->getAs<Condition>().message);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("condition-irritants");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(String));
+			if (args.size() != 1 || !args[0]->typep<Condition>())
+				throw "bad arguments for function 'condition-irritants'";
+			return args[0]->getAs<Condition>().irritants;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("proc?");
+	obj = intern("generator?");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1) throw "bad arguments for function 'nil'";
-			return boolToLobj(typeid(*args[0]) == typeid(Proc) ||
-												typeid(*args[0]) == typeid(BuiltinProc));
+			if (args.size() != 1) throw "bad arguments for function 'generator?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Generator));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("+");
+	obj = intern("generator-done?");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			int value = 0;
-			for (LobjSPtr &objPtr : args) {
-				if (typeid(*objPtr) != typeid(Int)) throw "bad arguments for function '+'";
-				value += dynamic_cast<Int*>(objPtr.get())->value;
-			}
-			return std::make_shared<Int>(value);
+			if (args.size() != 1 || !args[0]->typep<Generator>())
+				throw "bad arguments for function 'generator-done?'";
+			return boolToLobj(args[0]->getAs<Generator>().coroutine.isFinished());
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("-");
+	obj = intern("spawn");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() == 0 || typeid(*args[0]) != typeid(Int))
-				throw "bad arguments for function '-'";
-			int value = dynamic_cast<Int*>(args[0].get())->value;
-			if (args.size() == 1)
-				return std::make_shared<Int>(-value);
-			for (int i = 1; i < args.size(); ++i) {
-				if (typeid(*args[i]) != typeid(Int)) throw "bad arguments for function '-'";
-				value -= dynamic_cast<Int*>(args[i].get())->value;
-			}
-			return std::make_shared<Int>(value);
+			if (args.size() != 1 || !isCallable(args[0].get()))
+				throw "bad arguments for function 'spawn'";
+			std::shared_ptr<Task> task = newObj<Task>(args[0], env.makeInnerEnv());
+			currentInterpreter->eventLoop().spawn(task);
+			return task;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("*");
+	obj = intern("join");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			int value = 1;
-			for (LobjSPtr &objPtr : args) {
-				if (typeid(*objPtr) != typeid(Int)) throw "bad arguments for function '*'";
-				value *= dynamic_cast<Int*>(objPtr.get())->value;
-			}
-			return std::make_shared<Int>(value);
+			if (args.size() != 1 || !args[0]->typep<Task>())
+				throw "bad arguments for function 'join'";
+			Task &task = args[0]->getAs<Task>();
+			currentInterpreter->eventLoop().join(task);
+			return task.value == nullptr ? nil() : task.value;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("/");
+	obj = intern("task?");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() == 0 || typeid(*args[0]) != typeid(Int))
-				throw "bad arguments for function '/'";
-			int value = dynamic_cast<Int*>(args[0].get())->value;
-			for (int i = 1; i < args.size(); ++i) {
-				if (typeid(*args[i]) != typeid(Int)) throw "bad arguments for function '/'";
-				int divisor = dynamic_cast<Int*>(args[i].get())->value;
-				if (divisor == 0) throw "dividing by zero";
-				value /= divisor;
-			}
-			return std::make_shared<Int>(value);
+			if (args.size() != 1) throw "bad arguments for function 'task?'";
+			return boolToLobj(typeid(*args[0]) == typeid(Task));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("mod");
+	obj = intern("sleep");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 2 ||
-					typeid(*args[0]) != typeid(Int) || typeid(*args[1]) != typeid(Int))
-				throw "bad arguments for function 'mod'";
-			int value = dynamic_cast<Int*>(args[0].get())->value;
-			int divisor = dynamic_cast<Int*>(args[1].get())->value;
-			if (divisor == 0) throw "dividing by zero";
-			return std::make_shared<Int>(value % divisor);
+			if (args.size() != 1 || !args[0]->typep<Int>())
+				throw "bad arguments for function 'sleep'";
+			currentInterpreter->eventLoop().sleep(args[0]->getAs<Int>().value);
+			return nil();
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("=");
+	obj = intern("run-tasks");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() == 0) throw "bad arguments for function '='";
-			for (LobjSPtr &objPtr : args) {
-				if (typeid(*objPtr) != typeid(Int)) throw "bad arguments for function '='";
-		}
-		for (int i = 0; i < args.size() - 1; ++i) {
-			if (dynamic_cast<Int*>(args[i].get())->value !=
-					dynamic_cast<Int*>(args[i+1].get())->value)
-				return intern("nil");
-		}
-		return intern("t");
-	});
+			if (args.size() != 0)
+				throw "bad arguments for function 'run-tasks'";
+			EventLoop &loop = currentInterpreter->eventLoop();
+			if (loop.inTask())
+				throw "run-tasks called from a task";
+			loop.run();
+			return nil();
+		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("<");
+	obj = intern("listen");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() == 0) throw "bad arguments for function '<'";
-			for (LobjSPtr &objPtr : args) {
-				if (typeid(*objPtr) != typeid(Int)) throw "bad arguments for function '<'";
-			}
-			for (int i = 0; i < args.size() - 1; ++i) {
-				if (dynamic_cast<Int*>(args[i].get())->value >=
-						dynamic_cast<Int*>(args[i+1].get())->value)
-					return intern("nil");
-			}
-			return intern("t");
+			if (args.size() != 1)
+				throw "bad arguments for function 'listen'";
+			EventLoop &loop = currentInterpreter->eventLoop();
+			int fd = loop.listen(socketAddress(args[0].get(), "bad arguments for function 'listen'"));
+			if (fd < 0) throw "cannot listen";
+			return newObj<Listener>(loop, fd);
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("print");
+	obj = intern("accept");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			for (LobjSPtr &objPtr : args) {
-				objPtr->print(std::cout);
-			}
-			return intern("nil");
+			if (args.size() != 1 || !args[0]->typep<Listener>())
+				throw "bad arguments for function 'accept'";
+			if (args[0]->getAs<Listener>().fd < 0) throw "port is closed";
+			EventLoop &loop = currentInterpreter->eventLoop();
+			int fd = loop.accept(args[0]->getAs<Listener>().fd);
+			if (fd < 0) throw "cannot accept";
+			return newObj<Socket>(std::make_shared<AsyncStreamBuf>(loop, fd));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("println");
+	obj = intern("connect");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			for (LobjSPtr &objPtr : args) {
-				objPtr->print(std::cout);
-				std::cout << std::endl;
-			}
-			return intern("nil");
+			if (args.size() != 1)
+				throw "bad arguments for function 'connect'";
+			EventLoop &loop = currentInterpreter->eventLoop();
+			int fd = loop.connect(socketAddress(args[0].get(), "bad arguments for function 'connect'"));
+			if (fd < 0) throw "cannot connect";
+			return newObj<Socket>(std::make_shared<AsyncStreamBuf>(loop, fd));
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
-	obj = intern("print-to-string");
+	obj = intern("make-pipe");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			std::stringstream ss;
-			for (LobjSPtr &objPtr : args) {
-				objPtr->print(ss);
+			if (args.size() != 0)
+				throw "bad arguments for function 'make-pipe'";
+			int fds[2];
+			if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) throw "cannot make pipe";
+			EventLoop &loop = currentInterpreter->eventLoop();
+			std::vector<LobjSPtr> ports{
+				newObj<InputPort>(std::make_shared<AsyncStreamBuf>(loop, fds[0])),
+				newObj<OutputPort>(std::make_shared<AsyncStreamBuf>(loop, fds[1]))};
+			return vectorToList(ports);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("pmap");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2)
+				throw "bad arguments for function 'pmap'";
+			LobjSPtr func = args[0];
+			std::vector<LobjSPtr> elements = seqToVector(args[1], "bad arguments for function 'pmap'");
+			std::vector<LobjSPtr> results(elements.size());
+			parallelFor(elements.size(), [&](size_t begin, size_t end) {
+					std::vector<LobjSPtr> fargs(1);
+					for (size_t i = begin; i < end; ++i) {
+						fargs[0] = elements[i];
+						results[i] = env.apply(func, fargs);
+					}
+				});
+			return vectorToList(results);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("preduce");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 3)
+				throw "bad arguments for function 'preduce'";
+			LobjSPtr func = args[0], init = args[1];
+			std::vector<LobjSPtr> elements = seqToVector(args[2], "bad arguments for function 'preduce'");
+			if (elements.empty()) return init;
+			// Each chunk folds from init; the partial results are then combined
+			// in order, so func must be associative with init as its identity.
+			size_t chunks = std::min(elements.size(), ThreadPool::shared().size() * 4);
+			std::vector<LobjSPtr> partial(chunks);
+			parallelFor(chunks, [&](size_t begin, size_t end) {
+					std::vector<LobjSPtr> fargs(2);
+					for (size_t c = begin; c < end; ++c) {
+						LobjSPtr acc = init;
+						for (size_t i = elements.size() * c / chunks; i < elements.size() * (c + 1) / chunks; ++i) {
+							fargs[0] = acc;
+							fargs[1] = elements[i];
+							acc = env.apply(func, fargs);
+						}
+						partial[c] = acc;
+					}
+				});
+			LobjSPtr acc = partial[0];
+			std::vector<LobjSPtr> fargs(2);
+			for (size_t c = 1; c < chunks; ++c) {
+				fargs[0] = acc;
+				fargs[1] = partial[c];
+				acc = env.apply(func, fargs);
 			}
-			return std::make_shared<String>(ss.str());
+			return acc;
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -764,7 +4282,29 @@ Env::Env() {
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
 			if (args.size() != 1 || typeid(*args[0]) != typeid(Cons))
 				throw "bad arguments for function 'cdr'";
-			return dynamic_cast<Cons*>(args[0].get())->cdr;
+			return cdrOf(args[0]);
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("set-car!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || typeid(*args[0]) != typeid(Cons))
+				throw "bad arguments for function 'set-car!'";
+			if (currentInterpreter->constants->isConstant(args[0].get()))
+				throw "cannot modify a quoted constant";
+			args[0]->getAs<Cons>().car = args[1];
+			return args[1];
+		});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("set-cdr!");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 2 || typeid(*args[0]) != typeid(Cons))
+				throw "bad arguments for function 'set-cdr!'";
+			if (currentInterpreter->constants->isConstant(args[0].get()))
+				throw "cannot modify a quoted constant";
+			args[0]->getAs<Cons>().setCdr(args[1]);
+			return args[1];
 		});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -772,21 +4312,23 @@ Env::Env() {
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
 		if (args.size() != 2)
 			throw "bad arguments for function 'cons'";
-		return std::make_shared<Cons>(args[0], args[1]);
+		return newObj<Cons>(args[0], args[1]);
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
 	obj = intern("gensym");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			std::stringstream ss;
+			std::string name = "#";
 			if (args.size() == 0) {
-				ss << "#g" << (gensymId++);
+				name += "g";
 			} else if (args.size() == 1 && typeid(*args[0]) == typeid(String)) {
-				ss << "#" << (static_cast<String*>(args[0].get())->value) << (gensymId++);
+				String *prefix = static_cast<String*>(args[0].get());
+				name.append(prefix->data(), prefix->length);
 			} else {
 				throw "bad arguments for function 'gensym'";
 			}
-			return std::make_shared<Symbol>(ss.str());
+			name += std::to_string(currentInterpreter->gensymId++);
+			return newObj<Symbol>(std::move(name));
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -802,7 +4344,7 @@ Env::Env() {
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
 			if (args.size() != 0)
 				throw "bad arguments for function 'get-time'";
-			return std::make_shared<Int>(static_cast<int>(std::clock() / (CLOCKS_PER_SEC / 1000)));
+			return makeInt(static_cast<int>(std::clock() / (CLOCKS_PER_SEC / 1000)));
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -816,30 +4358,50 @@ Env::Env() {
 
 	obj = intern("read");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-		if (args.size() != 0)
+		if (args.size() > 1)
 			throw "bad arguments for function 'read'";
-		return env.read(std::cin);
+		LobjSPtr o = env.read(inputArg(args, 0, "bad arguments for function 'read'"));
+		return o == nullptr ? nil() : o;
+	});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("load-extension");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+			if (args.size() != 1 || !args[0]->typep<String>())
+				throw "bad arguments for function 'load-extension'";
+			std::string error;
+			if (!loadExtension(args[0]->getAs<String>().str(), error)) {
+				std::cerr << error << std::endl;
+				return nil();
+			}
+			return boolToLobj(true);
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
 	obj = intern("load");
 	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
-			if (args.size() != 1 || typeid(*args[0]) != typeid(String))
+			if (args.size() != 1 || (!args[0]->typep<String>() && !args[0]->typep<InputPort>()))
 				throw "bad arguments for function 'load'";
-			std::string filename = dynamic_cast<String*>(args[0].get())->value;
-			std::ifstream ifs(filename);
-			if (ifs.fail()) return intern("nil");
+			LobjSPtr port = args[0];
+			std::string filename = "port";
+			if (port->typep<String>()) {
+				filename = port->getAs<String>().str();
+				port = openFilePort(filename, false);
+				if (port == nullptr) return nil();
+			}
+			std::istream &is = inputStream(port.get(), "bad arguments for function 'load'");
+			trace::Scope scope(trace::LOAD, filename.c_str());
 			try {
-				while (!ifs.eof()) {
-					LobjSPtr o = env.read(ifs);
+				while (is.good()) {
+					LobjSPtr o = env.read(is);
 					env.evalTop(o);
-					skipCommentOut(ifs);
+					skipCommentOut(is);
 				}
 			} catch (char const *e) {
-				std::cout << std::endl << "Parse failed." << std::endl;
-				return intern("nil");
+				diagnosticStream() << std::endl << "Parse failed." << std::endl;
+				return nil();
 			}
-			return intern("t");
+			return boolToLobj(true);
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -851,6 +4413,31 @@ Env::Env() {
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
+	obj = intern("trace-start");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+		if (args.size() != 0)
+			throw "bad arguments for function 'trace-start'";
+		trace::start();
+		return boolToLobj(true);
+	});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("trace-stop");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+		if (args.size() != 1 || typeid(*args[0]) != typeid(String))
+			throw "bad arguments for function 'trace-stop'";
+		return boolToLobj(trace::stop(args[0]->getAs<String>().str()));
+	});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
+	obj = intern("heap-dump");
+	bfunc = new BuiltinProc([](Env &env, std::vector<LobjSPtr> &args) {
+		if (args.size() != 1 || typeid(*args[0]) != typeid(String))
+			throw "bad arguments for function 'heap-dump'";
+		return boolToLobj(currentInterpreter->heapDump(args[0]->getAs<String>().str()));
+	});
+	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
+
 	obj = intern("exit");
 	bind(obj, &obj->getAs<Symbol>());
 
@@ -863,7 +4450,7 @@ Env::Env() {
 			throw "bad arguments for function 'env-print'";
 		env.print();
 		std::cout << std::endl;
-		return intern("nil");
+		return nil();
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 
@@ -873,7 +4460,7 @@ Env::Env() {
 			throw "bad arguments for function 'env-print-all'";
 		env.printAll(true);
 		std::cout << std::endl;
-		return intern("nil");
+		return nil();
 	});
 	bind(LobjSPtr(bfunc), &obj->getAs<Symbol>());
 }
@@ -888,6 +4475,8 @@ LobjSPtr Env::macroexpand (LobjSPtr objPtr) {
 LobjSPtr Env::macroexpandAll(LobjSPtr objPtr) {
 	if (!objPtr->typep<Cons>())
 		return objPtr;
+	if (coro::Coroutine::stackExhausted())
+		throw "stack overflow";
 	Cons *cons = &objPtr->getAs<Cons>();
 	if (cons->car->typep<Symbol>()) {
 		Symbol *opSymbol = &cons->car->getAs<Symbol>();
@@ -900,8 +4489,9 @@ LobjSPtr Env::macroexpandAll(LobjSPtr objPtr) {
 		//macro
 		if (op != nullptr && op->typep<Macro>()) {
 			Macro *macro = &op->getAs<Macro>();
+			trace::Scope scope(trace::MACRO, opSymbol->name.c_str());
 			EnvSPtr env = makeEnvForMacro(EnvSPtr(self), macro->env,
-																		macro->parameterList, cons->cdr);
+																		macro->parameterList, cdrOf(objPtr));
 			return macroexpandAll(env->eval(macro->body));
 		}
 	}
@@ -910,6 +4500,12 @@ LobjSPtr Env::macroexpandAll(LobjSPtr objPtr) {
 		});
 }
 
+// Where def binds: the current REPL session's environment, if any.
+const EnvSPtr &definitionEnv() {
+	const EnvSPtr &session = currentInterpreter->sessionEnv;
+	return session != nullptr ? session : currentInterpreter->rootEnv;
+}
+
 LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 	Cons *cons = &objPtr->getAs<Cons>();
 	Lobj *op = cons->car.get();
@@ -917,16 +4513,18 @@ LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 		return LobjSPtr(nullptr);
 
 	int length = listLength(cons);
-	std::string opName = op->getAs<Symbol>().name;
+	const std::string &opName = op->getAs<Symbol>().name;
 	if (opName == "if") {
 		if (length == 3 || length == 4) {
-			LobjSPtr cond = listNth(objPtr, 1);
-			if(!eval(cond)->isNil()) {
-				return eval(listNth(objPtr, 2), tail);
+			LobjSPtr cond = evalOrUnwind(listNth(objPtr, 1));
+			if (cond == nullptr) {
+				return cond;
+			} else if (!cond->isNil()) {
+				return evalOrUnwind(listNth(objPtr, 2), tail);
 			} else if (length == 4) {
-				return eval(listNth(objPtr, 3), tail);
+				return evalOrUnwind(listNth(objPtr, 3), tail);
 			} else {
-				return intern("nil");
+				return nil();
 			}
 		}
 	} else if (opName == "quote") {
@@ -934,20 +4532,23 @@ LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 			return listNth(objPtr, 1);
 	} else if (opName == "do") {
 		if (length == 1)
-			return intern("nil");
-		cons = &cons->cdr->getAs<Cons>();
-		while (cons->cdr->typep<Cons>()) {
-			eval(cons->car);
-			cons = &cons->cdr->getAs<Cons>();
+			return nil();
+		cons = &cons->cdrPtr()->getAs<Cons>();
+		while (cons->cdrPtr()->typep<Cons>()) {
+			if (evalOrUnwind(cons->car) == nullptr)
+				return nullptr;
+			cons = &cons->cdrPtr()->getAs<Cons>();
 		}
-		return eval(cons->car, tail);
+		return evalOrUnwind(cons->car, tail);
 	} else if (opName == "def") {
 		if (length == 3) {
 			LobjSPtr variable = listNth(objPtr, 1);
 			if (typeid(*variable) != typeid(Symbol))
 				throw "bad 'def'";
 			Symbol *symbol = dynamic_cast<Symbol*>(variable.get());
-			EnvSPtr env = rootEnv;
+			EnvSPtr env = definitionEnv();
+			if (env != currentInterpreter->rootEnv)
+				symbol->sessionDefined = true;
 			env->bind(eval(listNth(objPtr, 2), tail), symbol); // tail?
 			return variable;
 		}
@@ -958,7 +4559,11 @@ LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 				throw "bad 'set!'";
 			Symbol *symbol = dynamic_cast<Symbol*>(variable.get());
 			EnvSPtr env = resolveEnv(symbol);
-			if (env == nullptr) env = rootEnv;
+			if (env == nullptr) {
+				env = definitionEnv();
+				if (env != currentInterpreter->rootEnv)
+					symbol->sessionDefined = true;
+			}
 			LobjSPtr value = eval(listNth(objPtr, 2), tail);
 			env->bind(value, symbol);
 			return value;
@@ -972,16 +4577,18 @@ LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 		EnvSPtr env = makeInnerEnv();
 		while (!bindings->isNil()) {
 			LobjSPtr objSymbol = dynamic_cast<Cons*>(bindings.get())->car;
-			LobjSPtr objForm = dynamic_cast<Cons*>(dynamic_cast<Cons*>(bindings.get())->cdr.get())->car;
+			LobjSPtr objForm = bindings->getAs<Cons>().cdrPtr()->getAs<Cons>().car;
 			// TODO type check
-			env->bind(eval(objForm), &objSymbol->getAs<Symbol>());
+			LobjSPtr value = evalOrUnwind(objForm);
+			if (value == nullptr) return value;
+			env->bind(value, &objSymbol->getAs<Symbol>());
 			bindings = listNthCdr(bindings, 2);
 		}
 		if (tail && !closed) {
 			this->merge(env);
 			env = EnvSPtr(self);
 		}
-		return env->eval(std::make_shared<Cons>(intern("do"), listNthCdr(objPtr, 2)), TCO);
+		return env->evalOrUnwind(newObj<Cons>(currentInterpreter->doSymbol, listNthCdr(objPtr, 2)), TCO);
 	} else if (opName == "let*") {
 		if (length < 2) throw "bad let*";
 
@@ -996,38 +4603,396 @@ LobjSPtr Env::procSpecialForm(LobjSPtr objPtr, bool tail) {
 		}
 		while (!bindings->isNil()) {
 			LobjSPtr objSymbol = dynamic_cast<Cons*>(bindings.get())->car;
-			LobjSPtr objForm = dynamic_cast<Cons*>(dynamic_cast<Cons*>(bindings.get())->cdr.get())->car;
+			LobjSPtr objForm = bindings->getAs<Cons>().cdrPtr()->getAs<Cons>().car;
 			// TODO type check
 			Symbol *symbol = dynamic_cast<Symbol*>(objSymbol.get());
-			env->bind(env->eval(objForm), symbol);
+			LobjSPtr value = env->evalOrUnwind(objForm);
+			if (value == nullptr) return value;
+			env->bind(value, symbol);
 			bindings = listNthCdr(bindings, 2);
 		}
-		return env->eval(std::make_shared<Cons>(intern("do"), listNthCdr(objPtr, 2)), TCO);
+		return env->evalOrUnwind(newObj<Cons>(currentInterpreter->doSymbol, listNthCdr(objPtr, 2)), TCO);
+	} else if (opName == "while") {
+		if (length < 2) throw "bad while";
+		LobjSPtr cond = listNth(objPtr, 1), body = listNthCdr(objPtr, 2);
+		while (!eval(cond)->isNil()) {
+			chargeStep();
+			evalBody(body.get());
+		}
+		return nil();
+	} else if (opName == "with-limits") {
+		LobjSPtr spec = listNth(objPtr, 1);
+		if (length < 2 || !isProperList(spec.get()) || listLength(spec.get()) % 2 != 0)
+			throw "bad with-limits";
+		Limits limits;
+		for (Lobj *o = spec.get(); o->typep<Cons>(); o = o->getAs<Cons>().cdrPtr()->getAs<Cons>().cdrPtr()) {
+			Lobj *key = o->getAs<Cons>().car.get();
+			int64_t n;
+			if (!key->typep<Symbol>() || !toInt64(eval(o->getAs<Cons>().cdrPtr()->getAs<Cons>().car), n) || n < 0)
+				throw "bad with-limits";
+			const std::string &name = key->getAs<Symbol>().name;
+			if (name == ":steps")
+				limits.steps = n;
+			else if (name == ":bytes")
+				limits.bytes = n;
+			else if (name == ":ms")
+				limits.ms = n;
+			else
+				throw "bad with-limits";
+		}
+		// The body is not evaluated in tail position: the budget has to stay
+		// in place until it returns.
+		BudgetScope scope(limits);
+		LobjSPtr value = nil();
+		for (Lobj *body = cons->cdrPtr()->getAs<Cons>().cdrPtr(); body->typep<Cons>(); body = body->getAs<Cons>().cdrPtr())
+			value = eval(body->getAs<Cons>().car);
+		return value;
+	} else if (opName == "catch") {
+		if (length < 2) throw "bad catch";
+		LobjSPtr tag = eval(listNth(objPtr, 1));
+		LobjSPtr value = nil();
+		try {
+			for (Lobj *body = cons->cdrPtr()->getAs<Cons>().cdrPtr(); body->typep<Cons>(); body = body->getAs<Cons>().cdrPtr()) {
+				value = evalOrUnwind(body->getAs<Cons>().car);
+				if (value != nullptr) continue;
+				if (!pendingThrow.tag->eq(tag.get())) return value;
+				pendingThrow.active = false;
+				pendingThrow.tag = nullptr;
+				return std::move(pendingThrow.value);
+			}
+		} catch (ThrowSignal &s) {
+			if (!s.tag->eq(tag.get())) throw;
+			value = s.value;
+		}
+		return value;
+	} else if (opName == "unwind-protect") {
+		if (length < 2) throw "bad unwind-protect";
+		LobjSPtr value;
+		std::exception_ptr error;
+		PendingThrow pending;
+		try {
+			value = evalOrUnwind(listNth(objPtr, 1));
+		} catch (...) {
+			error = std::current_exception();
+		}
+		// A throw passing through waits while the cleanup runs, and is
+		// dropped if the cleanup leaves by an error or a throw of its own.
+		if (value == nullptr && !error)
+			std::swap(pending, pendingThrow);
+		// The cleanup runs outside the handler, so that it may suspend a
+		// generator or task like any other code.
+		evalBody(cons->cdrPtr()->getAs<Cons>().cdrPtr());
+		if (error) std::rethrow_exception(error);
+		std::swap(pending, pendingThrow);
+		return value;
+	} else if (opName == "handler-case") {
+		if (length < 2) throw "bad handler-case";
+		LobjSPtr condition;
+		std::exception_ptr error;
+		try {
+			// A throw is never handled, so it passes as a return.
+			return evalOrUnwind(listNth(objPtr, 1));
+		} catch (...) {
+			condition = currentCondition();
+			error = std::current_exception();
+		}
+		// Each clause is (kind (variable) body...); kind `error` matches any
+		// condition and the variable list may be empty.
+		LobjSPtr errorSymbol = intern("error");
+		for (LobjSPtr clauses = listNthCdr(objPtr, 2); clauses->typep<Cons>(); clauses = cdrOf(clauses)) {
+			LobjSPtr clause = clauses->getAs<Cons>().car;
+			if (!isProperList(clause.get()) || listLength(clause.get()) < 2)
+				throw "bad handler-case";
+			Lobj *kind = clause->getAs<Cons>().car.get();
+			if (kind != errorSymbol.get() && kind != condition->getAs<Condition>().kind.get())
+				continue;
+			LobjSPtr variables = listNth(clause, 1);
+			EnvSPtr env = makeInnerEnv();
+			if (variables->typep<Cons>()) {
+				if (!variables->getAs<Cons>().car->typep<Symbol>()) throw "bad handler-case";
+				env->bind(condition, &variables->getAs<Cons>().car->getAs<Symbol>());
+			} else if (!variables->isNil()) {
+				throw "bad handler-case";
+			}
+			if (tail && !closed) {
+				this->merge(env);
+				env = EnvSPtr(self);
+			}
+			return env->eval(newObj<Cons>(currentInterpreter->doSymbol, listNthCdr(clause, 2)), TCO);
+		}
+		std::rethrow_exception(error);
+	} else if (opName == "dotimes" || opName == "dolist") {
+		LobjSPtr spec = listNth(objPtr, 1);
+		if (length < 2 || !isProperList(spec.get()) || listLength(spec.get()) < 2 || 3 < listLength(spec.get()) ||
+				!spec->getAs<Cons>().car->typep<Symbol>())
+			throw opName == "dotimes" ? "bad dotimes" : "bad dolist";
+		Symbol *symbol = &spec->getAs<Cons>().car->getAs<Symbol>();
+		LobjSPtr source = eval(listNth(spec, 1)), body = listNthCdr(objPtr, 2);
+		EnvSPtr env = makeInnerEnv();
+		if (opName == "dotimes") {
+			if (!source->typep<Int>()) throw "bad dotimes";
+			int64_t n = source->getAs<Int>().value;
+			env->bind(makeInt(0), symbol);
+			for (int64_t i = 0; i < n; ++i) {
+				chargeStep();
+				// Reuse the counter unless the body kept a reference to it. A
+				// future started by the body could take one on another thread
+				// at any moment, so not while any is running.
+				LobjSPtr &slot = env->symbolValueMap[symbol];
+				if (futuresRunning.load(std::memory_order_acquire) == 0 &&
+						slot.use_count() == 1 && slot->typep<Int>())
+					slot->getAs<Int>().value = i;
+				else
+					slot = makeInt(i);
+				env->evalBody(body.get());
+			}
+			env->bind(makeInt(n < 0 ? 0 : n), symbol);
+		} else {
+			LobjSPtr element;
+			while (seqNext(source, element, "bad dolist")) {
+				chargeStep();
+				env->bind(element, symbol);
+				env->evalBody(body.get());
+			}
+			env->bind(nil(), symbol);
+		}
+		LobjSPtr result = listNth(spec, 2);
+		return result == nullptr ? nil() : env->eval(result);
+	} else if (opName == "future") {
+		if (length != 2) throw "bad future";
+		closed = true;
+		std::shared_ptr<Future> future = newObj<Future>();
+		LobjSPtr expr = listNth(objPtr, 1);
+		EnvSPtr env = EnvSPtr(self);
+		Interpreter *interpreter = currentInterpreter;
+		futuresRunning.fetch_add(1, std::memory_order_relaxed);
+		ThreadPool::shared().submit([future, expr, env, interpreter]() {
+				PoolTaskScope scope(*interpreter);
+				try {
+					future->value = env->makeInnerEnv()->eval(expr);
+				} catch (...) {
+					future->error = std::current_exception();
+				}
+				future->done.store(true, std::memory_order_release);
+				futuresRunning.fetch_sub(1, std::memory_order_release);
+			});
+		return future;
+	} else if (opName == "delay") {
+		if (length != 2) throw "bad delay";
+		closed = true;
+		return newObj<Promise>(listNth(objPtr, 1), EnvSPtr(self));
 	} else if (opName == "\\") {
 		if (2 <= length) {
 			LobjSPtr pl = listNth(objPtr, 1);
 			//if (!isProperList(pl.get())) throw "bad lambda form";
 			closed = true;
-			return std::make_shared<Proc>(pl, std::make_shared<Cons>(intern("do"), listNthCdr(objPtr, 2)), EnvSPtr(self));
+			return newObj<Proc>(pl, newObj<Cons>(currentInterpreter->doSymbol, listNthCdr(objPtr, 2)), EnvSPtr(self));
 		}
 	} else if (opName == "macro") {
 		if (2 <= length) {
 			LobjSPtr pl = listNth(objPtr, 1);
 			//if (!isProperList(pl.get())) throw "bad lambda form";
 			closed = true;
-			return std::make_shared<Macro>(pl, std::make_shared<Cons>(intern("do"), listNthCdr(objPtr, 2)), EnvSPtr(self));
+			return newObj<Macro>(pl, newObj<Cons>(currentInterpreter->doSymbol, listNthCdr(objPtr, 2)), EnvSPtr(self));
 		}
 	}
 	return LobjSPtr(nullptr);
 }
 
-LobjSPtr Env::eval(LobjSPtr objPtr, bool tail) {
-	//objPtr->print(std::cout); std::cout << " | ";
+// Writes the objects reachable from the interpreter's roots as JSON lines
+// after a header line, one object per line:
+//   {"id":3,"type":"Symbol","size":72,"refs":[9],"root":"symbol-table","name":"fib"}
+// Ids are assigned in the order objects are found. `size` is what the
+// object itself owns; tools/heap_analyze.py works out what it retains.
+// Objects referred to only from the C++ stack, such as the arguments of
+// calls in progress, are not found.
+class HeapDump : public HeapWalker {
+	enum Kind { OBJECT, ENV, BLOCK };
+
+	struct Node {
+		Kind kind;
+		const void *address;
+		const char *root;
+		const char *type;
+		size_t size;
+	};
+
+	std::ostream &os;
+	std::unordered_map<const void*, uint64_t> ids;
+	std::vector<std::pair<uint64_t, Node> > pending;
+	std::vector<uint64_t> refs;
+	std::map<const std::type_info*, std::string> typeNames;
+
+	uint64_t idOf(const Node &node) {
+		auto found = ids.find(node.address);
+		if (found != ids.end())
+			return found->second;
+		uint64_t id = ids.size() + 1;
+		ids.emplace(node.address, id);
+		pending.emplace_back(id, node);
+		return id;
+	}
+
+	const std::string &typeName(const Lobj *obj) {
+		const std::type_info *type = &typeid(*obj);
+		auto found = typeNames.find(type);
+		if (found != typeNames.end())
+			return found->second;
+		int status;
+		char *name = abi::__cxa_demangle(type->name(), nullptr, nullptr, &status);
+		std::string &result = typeNames[type];
+		result = status == 0 ? name : type->name();
+		std::free(name);
+		return result;
+	}
+
+	void write(uint64_t id, const Node &node) {
+		refs.clear();
+		size_t size = node.size;
+		const char *type = node.type;
+		Lobj *obj = nullptr;
+		if (node.kind == OBJECT) {
+			obj = const_cast<Lobj*>(static_cast<const Lobj*>(node.address));
+			type = typeName(obj).c_str();
+			size = obj->size();
+			obj->forEachRef(*this);
+		} else if (node.kind == ENV) {
+			Env *env = const_cast<Env*>(static_cast<const Env*>(node.address));
+			size = env->size();
+			env->forEachRef(*this);
+		}
+		os << "{\"id\":" << id << ",\"type\":\"" << type << "\",\"size\":" << size << ",\"refs\":[";
+		for (size_t i = 0; i < refs.size(); ++i)
+			os << (i == 0 ? "" : ",") << refs[i];
+		os << "]";
+		if (node.root != nullptr)
+			os << ",\"root\":\"" << node.root << "\"";
+		if (obj != nullptr && obj->typep<Symbol>()) {
+			os << ",\"name\":";
+			trace::writeJsonString(os, obj->getAs<Symbol>().name.c_str());
+		}
+		os << "}\n";
+	}
+
+public:
+	HeapDump (std::ostream &o)
+	: os(o) {
+		os << "{\"format\":\"lisp-heap\",\"version\":1}\n";
+	}
+
+	void root(const Lobj *obj, const char *name) {
+		if (obj != nullptr)
+			idOf(Node{OBJECT, obj, name, nullptr, 0});
+	}
+
+	void root(const Env *env, const char *name) {
+		if (env != nullptr)
+			idOf(Node{ENV, env, name, "Env", 0});
+	}
+
+	void ref(const Lobj *obj) {
+		if (obj != nullptr)
+			refs.push_back(idOf(Node{OBJECT, obj, nullptr, nullptr, 0}));
+	}
+
+	void ref(const Env *env) {
+		if (env != nullptr)
+			refs.push_back(idOf(Node{ENV, env, nullptr, "Env", 0}));
+	}
+
+	void ref(const void *block, const char *type, size_t size) {
+		if (block != nullptr)
+			refs.push_back(idOf(Node{BLOCK, block, nullptr, type, size}));
+	}
+
+	using HeapWalker::ref;
+
+	// Writes every object found so far and everything reachable from them.
+	void run() {
+		while (!pending.empty()) {
+			std::pair<uint64_t, Node> next = pending.back();
+			pending.pop_back();
+			write(next.first, next.second);
+		}
+	}
+};
+
+// Set by SIGUSR1. The thread running the REPL checks it at every evaluation
+// and writes heap-PID-N.jsonl in the working directory. The handler also
+// wakes that thread's event loop, so an idle REPL or server dumps at once.
+std::atomic<bool> heapDumpRequested(false);
+std::atomic<int> heapDumpWakeFd(-1);
+thread_local bool heapDumpThread = false;
+
+void requestHeapDump(int) {
+	heapDumpRequested.store(true, std::memory_order_relaxed);
+	int fd = heapDumpWakeFd.load(std::memory_order_relaxed);
+	if (fd >= 0) {
+		int savedErrno = errno;
+		uint64_t one = 1;
+		ssize_t written = ::write(fd, &one, sizeof one);
+		(void)written;
+		errno = savedErrno;
+	}
+}
+
+void writeRequestedHeapDump() {
+	static int count = 0;
+	if (!heapDumpThread || !heapDumpRequested.exchange(false))
+		return;
+	std::string path = "heap-" + std::to_string(getpid()) + "-" + std::to_string(++count) + ".jsonl";
+	if (currentInterpreter->heapDump(path))
+		std::cerr << "Heap dump written to " << path << std::endl;
+	else
+		std::cerr << "Cannot write heap dump to " << path << std::endl;
+}
+
+// The argument vector of a builtin call, taken from a per-thread free list
+// so that calls allocate nothing for their arguments. A free list rather
+// than a stack indexed by depth, since a generator can suspend in the
+// middle of a call and leave its vector in use.
+class ArgsVector {
+	typedef std::unique_ptr<std::vector<LobjSPtr> > Ptr;
+	static const size_t keepCapacity = 64;
+	Ptr args;
+
+	static std::vector<Ptr> &freeList() {
+		thread_local std::vector<Ptr> list;
+		return list;
+	}
+
+public:
+	ArgsVector() {
+		std::vector<Ptr> &list = freeList();
+		if (list.empty()) {
+			args.reset(new std::vector<LobjSPtr>());
+		} else {
+			args = std::move(list.back());
+			list.pop_back();
+		}
+	}
+
+	~ArgsVector() {
+		args->clear();
+		if (args->capacity() <= keepCapacity)
+			freeList().push_back(std::move(args));
+	}
+
+	std::vector<LobjSPtr> &operator*() { return *args; }
+};
+
+const char *traceName(Cons *form) {
+	if (form->car->typep<Symbol>())
+		return form->car->getAs<Symbol>().name.c_str();
+	return "lambda";
+}
+
+LobjSPtr Env::evalOrUnwind(LobjSPtr objPtr, bool tail) {
 	Lobj *o = objPtr.get();
 	if (o->typep<Symbol>()) {
 		LobjSPtr rr = resolve(&o->getAs<Symbol>());
 		if (rr == nullptr) {
-			std::cout << "unbound symbol: " << o->getAs<Symbol>().name << std::endl;
+			diagnosticStream() << "unbound symbol: " << o->getAs<Symbol>().name << std::endl;
 			throw "evaluated unbound symbol";
 		}
 		return rr;
@@ -1036,58 +5001,346 @@ LobjSPtr Env::eval(LobjSPtr objPtr, bool tail) {
 		return objPtr;
 	}
 	if (o->typep<Cons>()) {
+		chargeStep();
+		if (coro::Coroutine::stackExhausted())
+			throw "stack overflow";
+		if (heapDumpRequested.load(std::memory_order_relaxed))
+			writeRequestedHeapDump();
 		LobjSPtr psfr = procSpecialForm(objPtr, tail);
-		if (psfr != nullptr) {
+		if (psfr != nullptr || pendingThrow.active) {
 			return psfr;
 		}
 
 		Cons *cons = &o->getAs<Cons>();
-		LobjSPtr opPtr = eval(cons->car);
+		LobjSPtr opPtr = evalOrUnwind(cons->car);
+		if (opPtr == nullptr)
+			return opPtr;
 		if (opPtr->typep<Proc>()) {
 			Proc *func = &opPtr->getAs<Proc>();
+			trace::Scope scope(trace::CALL, trace::enabled() ? traceName(cons) : "");
 			EnvSPtr env = makeEnvForApply(EnvSPtr(self), func->env,
-																		func->parameterList, cons->cdr, tail);
-			return env->eval(func->body, TCO);
+																		func->parameterList, cdrOf(objPtr), tail);
+			return env->evalOrUnwind(func->body, TCO);
 		}
 
 		if (opPtr->typep<BuiltinProc>()) {
 			BuiltinProc *bfunc = &opPtr->getAs<BuiltinProc>();
-			Lobj *argCons = cons->cdr.get();
+			trace::Scope scope(trace::BUILTIN, trace::enabled() ? traceName(cons) : "");
+			Lobj *argCons = cons->cdrPtr();
 			if (!isProperList(argCons))
 				throw "bad built-in-function call";
+			ArgsVector buffer;
+			std::vector<LobjSPtr> &args = *buffer;
+			while (!argCons->isNil()) {
+				LobjSPtr arg = evalOrUnwind(argCons->getAs<Cons>().car);
+				if (arg == nullptr) return arg;
+				args.push_back(std::move(arg));
+				argCons = argCons->getAs<Cons>().cdrPtr();
+			}
+			return bfunc->call(*this, args);
+		}
+
+		if (opPtr->typep<MemoProc>()) {
+			Lobj *argCons = cons->cdrPtr();
+			if (!isProperList(argCons))
+				throw "bad memoized function call";
 			std::vector<LobjSPtr> args;
 			while (!argCons->isNil()) {
-				args.push_back(eval(argCons->getAs<Cons>().car));
-				argCons = argCons->getAs<Cons>().cdr.get();
+				LobjSPtr arg = evalOrUnwind(argCons->getAs<Cons>().car);
+				if (arg == nullptr) return arg;
+				args.push_back(std::move(arg));
+				argCons = argCons->getAs<Cons>().cdrPtr();
 			}
-			return bfunc->function(*this, args);
+			return opPtr->getAs<MemoProc>().call(*this, args);
 		}
 		throw "bad apply";
 	}
 	return objPtr;
 }
 
+LobjSPtr Env::apply(LobjSPtr opPtr, std::vector<LobjSPtr> &args) {
+	if (opPtr->typep<Proc>()) {
+		Proc *func = &opPtr->getAs<Proc>();
+		trace::Scope scope(trace::CALL, "lambda");
+		EnvSPtr env = makeInnerEnv(func->env);
+		LobjSPtr prms = func->parameterList;
+		size_t i = 0;
+		for (; prms->typep<Cons>() && i < args.size(); ++i) {
+			env->bind(args[i], &prms->getAs<Cons>().car->getAs<Symbol>());
+			prms = cdrOf(prms);
+		}
+		if (typeid(*prms) == typeid(Symbol) && !prms->isNil()) {
+			std::vector<LobjSPtr> rest(args.begin() + i, args.end());
+			env->bind(vectorToList(rest), &prms->getAs<Symbol>());
+		}
+		return env->eval(func->body, TCO);
+	}
+	if (opPtr->typep<BuiltinProc>()) {
+		LobjSPtr value = opPtr->getAs<BuiltinProc>().call(*this, args);
+		if (value == nullptr && pendingThrow.active)
+			raisePendingThrow();
+		return value;
+	}
+	if (opPtr->typep<MemoProc>())
+		return opPtr->getAs<MemoProc>().call(*this, args);
+	throw "bad apply";
+}
+
 std::string initializeCode = "(println \"Loding core file...\" (load \"core.lisp\"))";
 
+Interpreter::Interpreter(bool loadCore)
+: constants(new ConstantPool()) {
+	Scope scope(*this);
+	nilSymbol = intern("nil");
+	tSymbol = intern("t");
+	doSymbol = intern("do");
+	stdinPort = newObj<InputPort>(std::shared_ptr<std::streambuf>(std::cin.rdbuf(), [](std::streambuf*) {}));
+	currentOutputPort = newObj<OutputPort>(std::shared_ptr<std::streambuf>(std::cout.rdbuf(), [](std::streambuf*) {}));
+	rootEnv = Env::makeEnv();
+	if (loadCore) {
+		std::istringstream ss(initializeCode);
+		LobjSPtr objPtr = rootEnv->read(ss);
+		rootEnv->evalTop(objPtr);
+	}
+}
+
+Interpreter::~Interpreter() {
+	Scope scope(*this);
+	if (events != nullptr)
+		events->cancelAll();
+	// Global procedures refer back to the root environment; drop the
+	// bindings so those cycles are freed.
+	rootEnv->clearBindings();
+	rootEnv.reset();
+	symbolMap.clear();
+}
+
+LobjSPtr Interpreter::evalString(const std::string &code) {
+	Scope scope(*this);
+	std::istringstream is(code);
+	LobjSPtr value = nilSymbol;
+	skipCommentOut(is);
+	while (is.good()) {
+		LobjSPtr o = rootEnv->read(is);
+		if (o == nullptr) throw "parse failed";
+		try {
+			value = rootEnv->evalTop(o);
+		} catch (ThrowSignal&) {
+			throw "no catch for throw";
+		}
+		skipCommentOut(is);
+	}
+	return value;
+}
+
+LobjSPtr Interpreter::evalString(const std::string &code, const Limits &limits) {
+	Scope scope(*this);
+	BudgetScope budget(limits);
+	return evalString(code);
+}
+
+LobjSPtr Interpreter::callGlobal(const std::string &name, std::vector<LobjSPtr> args) {
+	Scope scope(*this);
+	LobjSPtr func = rootEnv->resolve(&intern(name)->getAs<Symbol>());
+	if (func == nullptr) throw "unbound symbol";
+	try {
+		return rootEnv->apply(func, args);
+	} catch (ThrowSignal&) {
+		throw "no catch for throw";
+	}
+}
+
+void Interpreter::registerBuiltin(const std::string &name, BuiltinFunction function) {
+	Scope scope(*this);
+	rootEnv->bind(newObj<BuiltinProc>(function), &intern(name)->getAs<Symbol>());
+}
+
+void Interpreter::repl() {
+	Scope scope(*this);
+	rootEnv->repl(std::cin, std::cout);
+}
+
+bool Interpreter::heapDump(const std::string &path) {
+	Scope scope(*this);
+	std::ofstream ofs(path);
+	if (ofs.fail()) return false;
+	HeapDump dump(ofs);
+	{
+		std::lock_guard<std::mutex> lock(symbolMutex);
+		for (auto &kv : symbolMap)
+			dump.root(kv.second.get(), "symbol-table");
+	}
+	dump.root(rootEnv.get(), "root-env");
+	dump.root(sessionEnv.get(), "session-env");
+	dump.root(stdinPort.get(), "stdin");
+	dump.root(currentOutputPort.get(), "output");
+	if (events != nullptr) {
+		events->forEachTask([&dump](EventLoop::Task *task) {
+				dump.root(dynamic_cast<Lobj*>(task), "task");
+			});
+	}
+	dump.run();
+	ofs.flush();
+	return !ofs.fail();
+}
+
+LobjSPtr makeString(const std::string &value) {
+	return newObj<String>(value);
+}
+
+bool toInt64(const LobjSPtr &obj, int64_t &value) {
+	if (!obj->typep<Int>()) return false;
+	value = obj->getAs<Int>().value;
+	return true;
+}
+
+std::string printToString(const LobjSPtr &obj) {
+	std::string str;
+	StringSink sink(str);
+	std::ostream os(&sink);
+	obj->print(os);
+	return str;
+}
+
+#ifndef LISP_NO_MAIN
+// Serves a REPL session per connection on a Unix socket, so short scripts
+// skip startup. Sessions share the warm root environment; each one gets its
+// own environment for def and its own standard ports. Never returns unless
+// the socket cannot be set up.
+int runServer(Interpreter &interpreter, const std::string &path) {
+	Interpreter::Scope scope(interpreter);
+	EventLoop &loop = interpreter.eventLoop();
+	EventLoop::Address address;
+	int listener = EventLoop::Address::local(path, address) ? loop.listen(address) : -1;
+	if (listener < 0) {
+		std::cerr << "cannot listen on " << path << std::endl;
+		return 1;
+	}
+	for (;;) {
+		int fd = loop.accept(listener);
+		if (fd < 0) continue;
+		std::shared_ptr<Socket> socket = newObj<Socket>(std::make_shared<AsyncStreamBuf>(loop, fd));
+		EnvSPtr session = interpreter.rootEnv->makeSessionEnv();
+		LobjSPtr thunk = newObj<BuiltinProc>([socket, session](Env &env, std::vector<LobjSPtr> &args) {
+				// Whatever escapes the REPL ends this session only.
+				try {
+					session->repl(socket->in, socket->out);
+				} catch (EventLoop::Cancelled&) {
+					throw;
+				} catch (...) {
+					reportError(socket->out, "Fatal error: ");
+				}
+				socket->close();
+				return nil();
+			});
+		std::shared_ptr<Task> task = newObj<Task>(thunk, session);
+		task->session = session;
+		task->input = socket;
+		task->output = socket;
+		loop.spawn(task);
+	}
+}
+
+// Sends standard input to a server and copies everything the session
+// writes back to standard output, as it arrives.
+int runClient(const std::string &path) {
+	EventLoop::Address address;
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || !EventLoop::Address::local(path, address) ||
+		::connect(fd, reinterpret_cast<const sockaddr*>(&address.storage), address.length) < 0) {
+		std::cerr << "cannot connect to " << path << std::endl;
+		return 1;
+	}
+	auto writeAll = [](int out, const char *p, ssize_t n) {
+		while (n > 0) {
+			ssize_t w = ::write(out, p, n);
+			if (w < 0 && errno == EINTR) continue;
+			if (w < 0) return false;
+			p += w;
+			n -= w;
+		}
+		return true;
+	};
+	std::vector<char> buf(1 << 16);
+	pollfd fds[2] = {{fd, POLLIN, 0}, {0, POLLIN, 0}};
+	for (;;) {
+		if (::poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		if (fds[0].revents) {
+			ssize_t n = ::read(fd, buf.data(), buf.size());
+			if (n <= 0 || !writeAll(1, buf.data(), n)) break;
+		}
+		if (fds[1].revents) {
+			ssize_t n = ::read(0, buf.data(), buf.size());
+			if (n <= 0) {
+				::shutdown(fd, SHUT_WR);
+				fds[1].fd = -1;
+			} else if (!writeAll(fd, buf.data(), n)) {
+				break;
+			}
+		}
+	}
+	::close(fd);
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
+	std::ios::sync_with_stdio(false);
+
 	bool initializeFlg = true;
+	std::string serverPath, clientPath;
 	for (int i = 0; i < argc; ++i) {
 		if (std::string("no-initialize") == argv[i])
 			initializeFlg = false;
+		else if (std::string("--server") == argv[i] && i + 1 < argc)
+			serverPath = argv[++i];
+		else if (std::string("--client") == argv[i] && i + 1 < argc)
+			clientPath = argv[++i];
 	}
 
-	rootEnv = Env::makeEnv();
-
-	if (initializeFlg) {
-		std::istringstream ss(initializeCode);
-		LobjSPtr objPtr = rootEnv->read(ss);
-		rootEnv->evalTop(objPtr);
+	// Writes to a closed socket fail with EPIPE instead of killing us.
+	signal(SIGPIPE, SIG_IGN);
+
+	// kill -USR1 writes a heap dump at the next evaluation, or right away
+	// when waiting on the event loop. Interrupted reads are restarted
+	// rather than reported as end of input.
+	struct sigaction action = {};
+	action.sa_handler = requestHeapDump;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, nullptr);
+	heapDumpThread = true;
+
+	if (!clientPath.empty())
+		return runClient(clientPath);
+
+	Interpreter interpreter(initializeFlg);
+	interpreter.eventLoop().onWakeup(writeRequestedHeapDump);
+	heapDumpWakeFd.store(interpreter.eventLoop().wakeupFd());
+
+	// Standard input waits on the event loop, so spawned tasks keep running
+	// while the REPL waits for a line.
+	std::shared_ptr<std::streambuf> input = std::make_shared<AsyncStreamBuf>(interpreter.eventLoop(), 0, false, true);
+	std::streambuf *savedInput = std::cin.rdbuf(input.get());
+	interpreter.stdinPort = newObj<InputPort>(input);
+
+	if (!serverPath.empty()) {
+		std::cout.flush();
+		int status = runServer(interpreter, serverPath);
+		heapDumpWakeFd.store(-1);
+		return status;
 	}
 
 	try {
-		rootEnv->repl();
+		interpreter.repl();
 	} catch (char const *e) {
 		std::cout << "Fatal error: " << e << std::endl;
+	} catch (LimitExceeded &e) {
+		std::cout << "Fatal error: " << e.message << std::endl;
 	}
+	std::cin.rdbuf(savedInput);
+	heapDumpWakeFd.store(-1);
 	return 0;
 }
+#endif
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Embedding interface.
+// Build lisp.cpp with -DLISP_NO_MAIN and link it into the host program.
+// Errors are thrown as `const char*`, as everywhere else in the interpreter,
+// except for the two types below.
+
+struct Lobj;
+class Env;
+class EventLoop;
+struct ConstantPool;
+
+typedef std::shared_ptr<Lobj> LobjSPtr;
+typedef std::weak_ptr<Lobj>   LobjWPtr;
+typedef std::shared_ptr<Env> EnvSPtr;
+typedef std::weak_ptr<Env>   EnvWPtr;
+
+typedef std::function<LobjSPtr(Env &env, std::vector<LobjSPtr> &)> BuiltinFunction;
+
+// Limits for one evaluation, as given to with-limits; zero means none.
+// Steps count evaluated forms and bytes count the memory allocated for
+// objects. Work done by tasks and on pool threads is not counted.
+struct Limits {
+	uint64_t steps = 0;
+	uint64_t bytes = 0;
+	uint64_t ms = 0;
+};
+
+// Thrown when an evaluation runs past its limits.
+struct LimitExceeded {
+	const char *message;
+};
+
+// Thrown by `error` in Lisp code when nothing there handles it. The
+// condition prints as its message followed by the irritants.
+struct LispError {
+	LobjSPtr condition;
+};
+
+// An interpreter instance: symbol table, global environment and standard
+// ports. Instances share no mutable state, so separate instances may run on
+// separate threads at the same time. Within one instance, future, pmap and
+// preduce evaluate on pool threads; interning is synchronized for them, but
+// global definitions and mutable objects are not.
+class Interpreter {
+	// Declared first so that it is destroyed last: ports and tasks held by
+	// the members below refer to it.
+	std::unique_ptr<EventLoop> events;
+
+public:
+	std::map<std::string, LobjSPtr> symbolMap;
+	std::mutex symbolMutex;
+	EnvSPtr rootEnv;
+	std::atomic<int> gensymId{0};
+	// Literal strings and quoted lists of the code read so far, each stored
+	// once however often it occurs.
+	std::unique_ptr<ConstantPool> constants;
+	LobjSPtr stdinPort;
+	LobjSPtr currentOutputPort;
+	// Where def binds while a REPL server session runs; the root environment
+	// when null.
+	EnvSPtr sessionEnv;
+
+	// Symbols the evaluator uses constantly, interned once.
+	LobjSPtr nilSymbol;
+	LobjSPtr tSymbol;
+	LobjSPtr doSymbol;
+
+	// Makes an interpreter the current one on this thread for the lifetime
+	// of the object. The API functions below do this themselves.
+	class Scope {
+		Interpreter *saved;
+
+	public:
+		Scope(Interpreter &interpreter);
+		~Scope();
+	};
+
+	// Loads core.lisp from the working directory when `loadCore` is true.
+	explicit Interpreter(bool loadCore = true);
+	~Interpreter();
+
+	Interpreter(const Interpreter&) = delete;
+	Interpreter &operator=(const Interpreter&) = delete;
+
+	static Interpreter *current();
+
+	// Runs the tasks started by spawn. Created on first use.
+	EventLoop &eventLoop();
+
+	LobjSPtr intern(const std::string &name);
+
+	// Evaluates every form in `code` and returns the value of the last one.
+	LobjSPtr evalString(const std::string &code);
+	// Throws LimitExceeded if the evaluation goes past `limits`.
+	LobjSPtr evalString(const std::string &code, const Limits &limits);
+	LobjSPtr callGlobal(const std::string &name, std::vector<LobjSPtr> args);
+	void registerBuiltin(const std::string &name, BuiltinFunction function);
+	void repl();
+	// Writes the objects reachable from the interpreter as JSON lines; see
+	// tools/heap_analyze.py. Returns false if the file cannot be written.
+	bool heapDump(const std::string &path);
+};
+
+LobjSPtr makeInt(int64_t value);
+LobjSPtr makeString(const std::string &value);
+bool toInt64(const LobjSPtr &obj, int64_t &value);
+std::string printToString(const LobjSPtr &obj);
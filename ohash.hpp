@@ -0,0 +1,180 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+// Open addressing hash map with linear probing.
+// Growing never rehashes the whole table at once: the previous table is kept
+// and a few of its slots are moved into the new one on every update, so the
+// cost of a resize is spread across the following operations.
+
+template <typename K, typename V, typename Hash, typename Eq>
+class OpenHashMap {
+	enum { EMPTY, FULL, DELETED };
+	static const size_t migrateStep = 16;
+
+	struct Slot {
+		K key;
+		V value;
+		size_t hash;
+		uint8_t state = EMPTY;
+	};
+
+	struct Table {
+		std::vector<Slot> slots;
+		size_t used = 0;
+		size_t live = 0;
+
+		size_t capacity() const { return slots.size(); }
+
+		template <typename E>
+		long find(const K &key, size_t hash, const E &equal) const {
+			if (live == 0) return -1;
+			size_t mask = slots.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask) {
+				const Slot &slot = slots[i];
+				if (slot.state == EMPTY)
+					return -1;
+				if (slot.state == FULL && slot.hash == hash && equal(slot.key, key))
+					return i;
+			}
+		}
+
+		// Requires that `key` is absent and that a free slot exists.
+		void add(const K &key, const V &value, size_t hash) {
+			size_t mask = slots.size() - 1;
+			size_t i = hash & mask;
+			while (slots[i].state == FULL)
+				i = (i + 1) & mask;
+			Slot &slot = slots[i];
+			if (slot.state == EMPTY) ++used;
+			slot.key = key;
+			slot.value = value;
+			slot.hash = hash;
+			slot.state = FULL;
+			++live;
+		}
+
+		void remove(size_t i) {
+			slots[i].state = DELETED;
+			slots[i].key = K();
+			slots[i].value = V();
+			--live;
+		}
+	};
+
+	Table table;
+	Table old;
+	size_t migrated = 0;
+	Hash hasher;
+	Eq equal;
+
+	bool resizing() const { return migrated < old.capacity(); }
+
+	void migrate(size_t steps) {
+		while (steps-- > 0 && resizing()) {
+			Slot &slot = old.slots[migrated++];
+			if (slot.state == FULL) {
+				table.add(slot.key, slot.value, slot.hash);
+				old.remove(migrated - 1);
+			}
+		}
+		if (!resizing() && old.capacity() != 0) {
+			old = Table();
+			migrated = 0;
+		}
+	}
+
+	// Entries still waiting in the old table count against the new one's load,
+	// so migration can never fill it up.
+	void reserveOne() {
+		if ((table.used + old.live + 1) * 4 <= table.capacity() * 3)
+			return;
+		size_t capacity = 8;
+		while (capacity < (size() + 1) * 4)
+			capacity *= 2;
+		Table next;
+		next.slots.resize(capacity);
+		if (resizing()) {
+			for (; migrated < old.capacity(); ++migrated) {
+				Slot &slot = old.slots[migrated];
+				if (slot.state == FULL) next.add(slot.key, slot.value, slot.hash);
+			}
+		}
+		old = std::move(table);
+		table = std::move(next);
+		migrated = 0;
+	}
+
+public:
+	OpenHashMap(Hash h = Hash(), Eq e = Eq())
+	: hasher(h), equal(e) {}
+
+	size_t size() const { return table.live + old.live; }
+
+	size_t memoryUsage() const {
+		return (table.capacity() + old.capacity()) * sizeof(Slot);
+	}
+
+	V *find(const K &key) {
+		size_t hash = hasher(key);
+		long i = table.find(key, hash, equal);
+		if (i >= 0) return &table.slots[i].value;
+		i = old.find(key, hash, equal);
+		if (i >= 0) return &old.slots[i].value;
+		return nullptr;
+	}
+
+	// Returns true if the key was newly added.
+	bool insert(const K &key, const V &value) {
+		migrate(migrateStep);
+		size_t hash = hasher(key);
+		long i = table.find(key, hash, equal);
+		if (i >= 0) {
+			table.slots[i].value = value;
+			return false;
+		}
+		bool added = true;
+		i = old.find(key, hash, equal);
+		if (i >= 0) {
+			old.remove(i);
+			added = false;
+		}
+		reserveOne();
+		table.add(key, value, hash);
+		return added;
+	}
+
+	bool erase(const K &key) {
+		migrate(migrateStep);
+		size_t hash = hasher(key);
+		long i = table.find(key, hash, equal);
+		if (i >= 0) {
+			table.remove(i);
+			return true;
+		}
+		i = old.find(key, hash, equal);
+		if (i >= 0) {
+			old.remove(i);
+			return true;
+		}
+		return false;
+	}
+
+	void clear() {
+		table = Table();
+		old = Table();
+		migrated = 0;
+	}
+
+	template <typename F>
+	void forEach(F f) {
+		for (Table *t : {&old, &table}) {
+			for (Slot &slot : t->slots) {
+				if (slot.state == FULL) f(slot.key, slot.value);
+			}
+		}
+	}
+};
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// Persistent (immutable) collections with structural sharing.
+//
+// Every node records the edit token of the transient that created it.
+// Persistent operations use token 0, which matches no node, so they copy
+// the path they change. A transient owns a fresh token and updates the
+// nodes it has already copied in place.
+
+inline uint64_t newEditToken() {
+	static std::atomic<uint64_t> counter(0);
+	return ++counter;
+}
+
+// Bit-partitioned vector trie with 32-way branching and a tail buffer.
+template <typename T>
+class PersistentVector {
+	struct Node {
+		uint64_t edit;
+		std::vector<std::shared_ptr<Node> > children;
+		std::vector<T> values;
+
+		Node(uint64_t e) : edit(e) {}
+	};
+	typedef std::shared_ptr<Node> NodePtr;
+
+	size_t cnt = 0;
+	unsigned shift = 5;
+	NodePtr root;
+	NodePtr tail;
+	uint64_t edit = 0;
+
+	NodePtr editable(const NodePtr &node) const {
+		if (edit != 0 && node->edit == edit)
+			return node;
+		NodePtr copy = std::make_shared<Node>(*node);
+		copy->edit = edit;
+		return copy;
+	}
+
+	size_t tailOffset() const {
+		return cnt < 32 ? 0 : ((cnt - 1) >> 5) << 5;
+	}
+
+	const Node *leafFor(size_t i) const {
+		if (i >= tailOffset())
+			return tail.get();
+		const Node *node = root.get();
+		for (unsigned level = shift; level > 0; level -= 5)
+			node = node->children[(i >> level) & 31].get();
+		return node;
+	}
+
+	NodePtr newPath(unsigned level, const NodePtr &node) const {
+		if (level == 0)
+			return node;
+		NodePtr r = std::make_shared<Node>(edit);
+		r->children.push_back(newPath(level - 5, node));
+		return r;
+	}
+
+	NodePtr pushTail(unsigned level, const NodePtr &parent, const NodePtr &tailNode) const {
+		size_t sub = ((cnt - 1) >> level) & 31;
+		NodePtr r = editable(parent);
+		NodePtr insert;
+		if (level == 5)
+			insert = tailNode;
+		else if (sub < parent->children.size())
+			insert = pushTail(level - 5, parent->children[sub], tailNode);
+		else
+			insert = newPath(level - 5, tailNode);
+		if (sub < r->children.size())
+			r->children[sub] = insert;
+		else
+			r->children.push_back(insert);
+		return r;
+	}
+
+	NodePtr popTail(unsigned level, const NodePtr &node) const {
+		size_t sub = ((cnt - 2) >> level) & 31;
+		if (level > 5) {
+			NodePtr child = popTail(level - 5, node->children[sub]);
+			if (child == nullptr && sub == 0)
+				return nullptr;
+			NodePtr r = editable(node);
+			if (child == nullptr)
+				r->children.pop_back();
+			else
+				r->children[sub] = child;
+			return r;
+		}
+		if (sub == 0)
+			return nullptr;
+		NodePtr r = editable(node);
+		r->children.pop_back();
+		return r;
+	}
+
+	NodePtr doAssoc(unsigned level, const NodePtr &node, size_t i, const T &x) const {
+		NodePtr r = editable(node);
+		if (level == 0)
+			r->values[i & 31] = x;
+		else
+			r->children[(i >> level) & 31] = doAssoc(level - 5, node->children[(i >> level) & 31], i, x);
+		return r;
+	}
+
+public:
+	PersistentVector()
+	: root(std::make_shared<Node>(0)), tail(std::make_shared<Node>(0)) {}
+
+	size_t size() const { return cnt; }
+
+	const T &operator[](size_t i) const {
+		return leafFor(i)->values[i & 31];
+	}
+
+	// In-place updates; on a persistent value they only replace this handle's path.
+	void pushBack(const T &x) {
+		if (cnt - tailOffset() < 32) {
+			tail = editable(tail);
+			tail->values.push_back(x);
+			++cnt;
+			return;
+		}
+		NodePtr tailNode = tail;
+		tail = std::make_shared<Node>(edit);
+		tail->values.push_back(x);
+		if ((cnt >> 5) > (static_cast<size_t>(1) << shift)) {
+			NodePtr r = std::make_shared<Node>(edit);
+			r->children.push_back(root);
+			r->children.push_back(newPath(shift, tailNode));
+			root = r;
+			shift += 5;
+		} else {
+			root = pushTail(shift, root, tailNode);
+		}
+		++cnt;
+	}
+
+	void set(size_t i, const T &x) {
+		if (i >= tailOffset()) {
+			tail = editable(tail);
+			tail->values[i & 31] = x;
+		} else {
+			root = doAssoc(shift, root, i, x);
+		}
+	}
+
+	void popBack() {
+		if (cnt == 1) {
+			root = std::make_shared<Node>(edit);
+			tail = std::make_shared<Node>(edit);
+			shift = 5;
+			cnt = 0;
+			return;
+		}
+		if (cnt - tailOffset() > 1) {
+			tail = editable(tail);
+			tail->values.pop_back();
+			--cnt;
+			return;
+		}
+		const Node *leaf = leafFor(cnt - 2);
+		NodePtr newTail = std::make_shared<Node>(*leaf);
+		newTail->edit = edit;
+		NodePtr newRoot = popTail(shift, root);
+		if (newRoot == nullptr)
+			newRoot = std::make_shared<Node>(edit);
+		if (shift > 5 && newRoot->children.size() == 1) {
+			newRoot = newRoot->children[0];
+			shift -= 5;
+		}
+		root = newRoot;
+		tail = newTail;
+		--cnt;
+	}
+
+	PersistentVector conj(const T &x) const {
+		PersistentVector r = persistent();
+		r.pushBack(x);
+		return r;
+	}
+
+	PersistentVector assoc(size_t i, const T &x) const {
+		PersistentVector r = persistent();
+		r.set(i, x);
+		return r;
+	}
+
+	PersistentVector pop() const {
+		PersistentVector r = persistent();
+		r.popBack();
+		return r;
+	}
+
+	PersistentVector transient() const {
+		PersistentVector r = *this;
+		r.edit = newEditToken();
+		return r;
+	}
+
+	PersistentVector persistent() const {
+		PersistentVector r = *this;
+		r.edit = 0;
+		return r;
+	}
+};
+
+// Hash array mapped trie.
+template <typename K, typename V, typename Hash, typename Eq>
+class HashTrieMap {
+	struct Node;
+	typedef std::shared_ptr<Node> NodePtr;
+
+	struct Entry {
+		NodePtr node;
+		K key;
+		V value;
+		size_t hash;
+	};
+
+	// A node whose entries all share one full hash is a collision node.
+	struct Node {
+		uint64_t edit;
+		uint32_t bitmap = 0;
+		bool collision = false;
+		std::vector<Entry> entries;
+
+		Node(uint64_t e) : edit(e) {}
+	};
+
+	size_t cnt = 0;
+	NodePtr root;
+	uint64_t edit = 0;
+	Hash hasher;
+	Eq equal;
+
+	NodePtr editable(const NodePtr &node) const {
+		if (edit != 0 && node->edit == edit)
+			return node;
+		NodePtr copy = std::make_shared<Node>(*node);
+		copy->edit = edit;
+		return copy;
+	}
+
+	static unsigned bitIndex(size_t hash, unsigned shift) {
+		return (hash >> shift) & 31;
+	}
+
+	static size_t position(uint32_t bitmap, unsigned bit) {
+		return __builtin_popcount(bitmap & ((1u << bit) - 1));
+	}
+
+	NodePtr pair(unsigned shift, const Entry &a, const Entry &b) const {
+		NodePtr node = std::make_shared<Node>(edit);
+		if (a.hash == b.hash || shift >= sizeof(size_t) * 8) {
+			node->collision = true;
+			node->entries.push_back(a);
+			node->entries.push_back(b);
+			return node;
+		}
+		unsigned ba = bitIndex(a.hash, shift), bb = bitIndex(b.hash, shift);
+		if (ba == bb) {
+			Entry e;
+			e.node = pair(shift + 5, a, b);
+			e.hash = 0;
+			node->entries.push_back(e);
+			node->bitmap = 1u << ba;
+			return node;
+		}
+		node->entries.push_back(ba < bb ? a : b);
+		node->entries.push_back(ba < bb ? b : a);
+		node->bitmap = (1u << ba) | (1u << bb);
+		return node;
+	}
+
+	NodePtr assocNode(const NodePtr &node, unsigned shift, const Entry &entry, bool &added) const {
+		if (node->collision) {
+			if (node->entries[0].hash != entry.hash) {
+				// Give the collision node a parent that can tell the two hashes apart.
+				NodePtr wrapper = std::make_shared<Node>(edit);
+				Entry child;
+				child.node = node;
+				child.hash = 0;
+				wrapper->entries.push_back(child);
+				wrapper->bitmap = 1u << bitIndex(node->entries[0].hash, shift);
+				return assocNode(wrapper, shift, entry, added);
+			}
+			NodePtr r = editable(node);
+			for (Entry &e : r->entries) {
+				if (equal(e.key, entry.key)) {
+					e.value = entry.value;
+					return r;
+				}
+			}
+			r->entries.push_back(entry);
+			added = true;
+			return r;
+		}
+		unsigned bit = bitIndex(entry.hash, shift);
+		size_t i = position(node->bitmap, bit);
+		if (!(node->bitmap & (1u << bit))) {
+			NodePtr r = editable(node);
+			r->entries.insert(r->entries.begin() + i, entry);
+			r->bitmap |= 1u << bit;
+			added = true;
+			return r;
+		}
+		const Entry &e = node->entries[i];
+		NodePtr r;
+		if (e.node != nullptr) {
+			NodePtr child = assocNode(e.node, shift + 5, entry, added);
+			r = editable(node);
+			r->entries[i].node = child;
+		} else if (e.hash == entry.hash && equal(e.key, entry.key)) {
+			r = editable(node);
+			r->entries[i].value = entry.value;
+		} else {
+			NodePtr child = pair(shift + 5, e, entry);
+			r = editable(node);
+			Entry &slot = r->entries[i];
+			slot.node = child;
+			slot.key = K();
+			slot.value = V();
+			added = true;
+		}
+		return r;
+	}
+
+	// Returns nullptr when the node becomes empty.
+	NodePtr dissocNode(const NodePtr &node, unsigned shift, const K &key, size_t hash, bool &removed) const {
+		if (node->collision) {
+			for (size_t i = 0; i < node->entries.size(); ++i) {
+				if (equal(node->entries[i].key, key)) {
+					removed = true;
+					if (node->entries.size() == 1)
+						return nullptr;
+					NodePtr r = editable(node);
+					r->entries.erase(r->entries.begin() + i);
+					return r;
+				}
+			}
+			return node;
+		}
+		unsigned bit = bitIndex(hash, shift);
+		if (!(node->bitmap & (1u << bit)))
+			return node;
+		size_t i = position(node->bitmap, bit);
+		const Entry &e = node->entries[i];
+		if (e.node != nullptr) {
+			NodePtr child = dissocNode(e.node, shift + 5, key, hash, removed);
+			if (!removed)
+				return node;
+			NodePtr r = editable(node);
+			if (child == nullptr) {
+				r->entries.erase(r->entries.begin() + i);
+				r->bitmap &= ~(1u << bit);
+			} else if (child->entries.size() == 1 && child->entries[0].node == nullptr) {
+				// Pull a lone key back up so equal maps keep the same shape.
+				r->entries[i] = child->entries[0];
+			} else {
+				r->entries[i].node = child;
+			}
+			return r->entries.empty() ? nullptr : r;
+		}
+		if (e.hash != hash || !equal(e.key, key))
+			return node;
+		removed = true;
+		if (node->entries.size() == 1)
+			return nullptr;
+		NodePtr r = editable(node);
+		r->entries.erase(r->entries.begin() + i);
+		r->bitmap &= ~(1u << bit);
+		return r;
+	}
+
+	template <typename F>
+	static void forEachNode(const Node *node, F &f) {
+		for (const Entry &e : node->entries) {
+			if (e.node != nullptr)
+				forEachNode(e.node.get(), f);
+			else
+				f(e.key, e.value);
+		}
+	}
+
+public:
+	HashTrieMap(Hash h = Hash(), Eq e = Eq())
+	: root(std::make_shared<Node>(0)), hasher(h), equal(e) {}
+
+	size_t size() const { return cnt; }
+
+	const V *find(const K &key) const {
+		size_t hash = hasher(key);
+		const Node *node = root.get();
+		for (unsigned shift = 0;; shift += 5) {
+			if (node->collision) {
+				for (const Entry &e : node->entries) {
+					if (equal(e.key, key)) return &e.value;
+				}
+				return nullptr;
+			}
+			unsigned bit = bitIndex(hash, shift);
+			if (!(node->bitmap & (1u << bit)))
+				return nullptr;
+			const Entry &e = node->entries[position(node->bitmap, bit)];
+			if (e.node == nullptr)
+				return e.hash == hash && equal(e.key, key) ? &e.value : nullptr;
+			node = e.node.get();
+		}
+	}
+
+	void set(const K &key, const V &value) {
+		Entry entry;
+		entry.key = key;
+		entry.value = value;
+		entry.hash = hasher(key);
+		bool added = false;
+		root = assocNode(root, 0, entry, added);
+		if (added) ++cnt;
+	}
+
+	bool erase(const K &key) {
+		bool removed = false;
+		NodePtr r = dissocNode(root, 0, key, hasher(key), removed);
+		if (!removed)
+			return false;
+		root = r != nullptr ? r : std::make_shared<Node>(edit);
+		--cnt;
+		return true;
+	}
+
+	HashTrieMap assoc(const K &key, const V &value) const {
+		HashTrieMap r = persistent();
+		r.set(key, value);
+		return r;
+	}
+
+	HashTrieMap dissoc(const K &key) const {
+		HashTrieMap r = persistent();
+		r.erase(key);
+		return r;
+	}
+
+	HashTrieMap transient() const {
+		HashTrieMap r = *this;
+		r.edit = newEditToken();
+		return r;
+	}
+
+	HashTrieMap persistent() const {
+		HashTrieMap r = *this;
+		r.edit = 0;
+		return r;
+	}
+
+	template <typename F>
+	void forEach(F f) const {
+		forEachNode(root.get(), f);
+	}
+};
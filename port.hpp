@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Stream buffer over a file descriptor with large input and output buffers.
+// Output is only written when the buffer fills or on an explicit sync, so
+// line-oriented output costs one write(2) per 64KiB rather than per line.
+
+class FdStreamBuf : public std::streambuf {
+	static const size_t bufferSize = 1 << 16;
+
+	int fd;
+	bool owned;
+	std::vector<char> inBuf;
+	std::vector<char> outBuf;
+
+	bool writeAll(const char *p, size_t n) {
+		while (n > 0) {
+			ssize_t w = ::write(fd, p, n);
+			if (w < 0) {
+				if (errno == EINTR) continue;
+				if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitReady(true)) continue;
+				return false;
+			}
+			p += w;
+			n -= w;
+		}
+		return true;
+	}
+
+	bool flushOut() {
+		if (outBuf.empty()) return true;
+		size_t n = pptr() - pbase();
+		setp(outBuf.data(), outBuf.data() + outBuf.size());
+		return writeAll(outBuf.data(), n);
+	}
+
+protected:
+	// Called when a non-blocking descriptor is not ready. Returns false to
+	// give up, which reports end of file or a failed write.
+	virtual bool waitReady(bool output) {
+		return false;
+	}
+
+	virtual ssize_t readSome(char *p, size_t n) {
+		for (;;) {
+			ssize_t r = ::read(fd, p, n);
+			if (r >= 0) return r;
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitReady(false)) continue;
+			return r;
+		}
+	}
+
+	int_type underflow() {
+		if (gptr() < egptr())
+			return traits_type::to_int_type(*gptr());
+		if (inBuf.empty()) inBuf.resize(bufferSize);
+		ssize_t r = readSome(inBuf.data(), inBuf.size());
+		if (r <= 0) return traits_type::eof();
+		setg(inBuf.data(), inBuf.data(), inBuf.data() + r);
+		return traits_type::to_int_type(*gptr());
+	}
+
+	// Large reads bypass the buffer once it is drained.
+	std::streamsize xsgetn(char *s, std::streamsize n) {
+		std::streamsize done = 0;
+		while (done < n) {
+			std::streamsize avail = egptr() - gptr();
+			if (avail > 0) {
+				std::streamsize k = std::min(avail, n - done);
+				std::memcpy(s + done, gptr(), k);
+				gbump(static_cast<int>(k));
+				done += k;
+			} else if (static_cast<size_t>(n - done) >= bufferSize) {
+				ssize_t r = readSome(s + done, n - done);
+				if (r <= 0) break;
+				done += r;
+			} else if (underflow() == traits_type::eof()) {
+				break;
+			}
+		}
+		return done;
+	}
+
+	int_type overflow(int_type c) {
+		if (outBuf.empty()) {
+			outBuf.resize(bufferSize);
+			setp(outBuf.data(), outBuf.data() + outBuf.size());
+		} else if (!flushOut()) {
+			return traits_type::eof();
+		}
+		if (c != traits_type::eof()) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	// Large writes bypass the buffer.
+	std::streamsize xsputn(const char *s, std::streamsize n) {
+		if (static_cast<size_t>(n) < bufferSize)
+			return std::streambuf::xsputn(s, n);
+		if (!flushOut() || !writeAll(s, n)) return 0;
+		return n;
+	}
+
+	int sync() {
+		return flushOut() ? 0 : -1;
+	}
+
+public:
+	FdStreamBuf(int f, bool o = true) : fd(f), owned(o) {}
+
+	~FdStreamBuf() {
+		sync();
+		if (owned) ::close(fd);
+	}
+
+	FdStreamBuf(const FdStreamBuf&) = delete;
+	FdStreamBuf &operator=(const FdStreamBuf&) = delete;
+
+	// Returns nullptr if the file cannot be opened.
+	static FdStreamBuf *open(const std::string &path, bool output, bool append = false) {
+		int flags = output ? O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) : O_RDONLY;
+		int f = ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+		return f < 0 ? nullptr : new FdStreamBuf(f);
+	}
+
+	int descriptor() const { return fd; }
+};
@@ -0,0 +1,50 @@
+// Sample native extension. From the top of the repository:
+//   g++ -std=c++11 -O2 -fPIC -shared -I. -o libsample.so sample/extension.cpp
+//   (load-extension "./libsample.so")
+//   (fnv1a "hello")              ; => -6615550055289275125
+//   (string-count "banana" "an") ; => 2
+
+#include <cstring>
+#include "extension.hpp"
+
+static const LispExtensionApi *api;
+
+static LobjSPtr fnv1a(Env &env, std::vector<LobjSPtr> &args) {
+	const char *data;
+	size_t length;
+	if (!api->toString(args[0], data, length))
+		throw "bad arguments for function 'fnv1a'";
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i) {
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return api->makeInt(static_cast<int64_t>(h));
+}
+
+// Counts non-overlapping occurrences of the second string in the first.
+static LobjSPtr stringCount(Env &env, std::vector<LobjSPtr> &args) {
+	const char *s, *pattern;
+	size_t n, m;
+	if (!api->toString(args[0], s, n) || !api->toString(args[1], pattern, m) || m == 0)
+		throw "bad arguments for function 'string-count'";
+	int64_t count = 0;
+	for (size_t i = 0; i + m <= n;) {
+		if (std::memcmp(s + i, pattern, m) == 0) {
+			++count;
+			i += m;
+		} else {
+			++i;
+		}
+	}
+	return api->makeInt(count);
+}
+
+extern "C" int lisp_extension_init(const LispExtensionApi *table) {
+	if (table->version < LISP_EXTENSION_API_VERSION)
+		return 1;
+	api = table;
+	api->defineBuiltin("fnv1a", 1, 1, fnv1a);
+	api->defineBuiltin("string-count", 2, 2, stringCount);
+	return 0;
+}
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+// Bulk kernels for typed vectors.
+// Every kernel has a portable scalar version; on x86 an SSE2 or AVX2 version
+// is selected once at startup according to what the running CPU supports.
+
+namespace simd {
+
+// Wrapping sum, minimum and maximum in one pass. n must be nonzero.
+inline void reduceInt64Scalar(const int64_t *p, size_t n, int64_t &sum, int64_t &min, int64_t &max) {
+	uint64_t s = 0;
+	int64_t lo = p[0], hi = p[0];
+	for (size_t i = 0; i < n; ++i) {
+		s += static_cast<uint64_t>(p[i]);
+		if (p[i] < lo) lo = p[i];
+		if (hi < p[i]) hi = p[i];
+	}
+	sum = static_cast<int64_t>(s);
+	min = lo;
+	max = hi;
+}
+
+inline uint64_t sumBytesScalar(const uint8_t *p, size_t n) {
+	uint64_t s = 0;
+	for (size_t i = 0; i < n; ++i)
+		s += p[i];
+	return s;
+}
+
+inline void minMaxBytesScalar(const uint8_t *p, size_t n, uint8_t &min, uint8_t &max) {
+	uint8_t lo = 255, hi = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (p[i] < lo) lo = p[i];
+		if (hi < p[i]) hi = p[i];
+	}
+	min = lo;
+	max = hi;
+}
+
+// Elementwise r = a + b; returns false if any element overflowed.
+inline bool addInt64Scalar(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	bool ok = true;
+	for (size_t i = 0; i < n; ++i)
+		ok &= !__builtin_add_overflow(a[i], b[i], &r[i]);
+	return ok;
+}
+
+inline bool subInt64Scalar(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	bool ok = true;
+	for (size_t i = 0; i < n; ++i)
+		ok &= !__builtin_sub_overflow(a[i], b[i], &r[i]);
+	return ok;
+}
+
+inline bool mulInt64(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	bool ok = true;
+	for (size_t i = 0; i < n; ++i)
+		ok &= !__builtin_mul_overflow(a[i], b[i], &r[i]);
+	return ok;
+}
+
+// Byte arithmetic wraps modulo 256.
+inline void addBytesScalar(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		r[i] = static_cast<uint8_t>(a[i] + b[i]);
+}
+
+inline void subBytesScalar(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		r[i] = static_cast<uint8_t>(a[i] - b[i]);
+}
+
+inline void mulBytes(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		r[i] = static_cast<uint8_t>(a[i] * b[i]);
+}
+
+inline void fillInt64Scalar(int64_t *p, size_t n, int64_t v) {
+	for (size_t i = 0; i < n; ++i)
+		p[i] = v;
+}
+
+// Returns the index of the first element equal to v, or n.
+inline size_t findInt64Scalar(const int64_t *p, size_t n, int64_t v) {
+	for (size_t i = 0; i < n; ++i) {
+		if (p[i] == v) return i;
+	}
+	return n;
+}
+
+inline size_t findBytes(const uint8_t *p, size_t n, uint8_t v) {
+	const void *q = std::memchr(p, v, n);
+	return q ? static_cast<const uint8_t*>(q) - p : n;
+}
+
+// Index of the first occurrence of q[0..m) in p[0..n), or n if there is none.
+// Candidates are located with memchr on the needle's last byte, which libc
+// vectorizes, and are then confirmed with memcmp.
+inline size_t findSequence(const uint8_t *p, size_t n, const uint8_t *q, size_t m) {
+	if (m == 0) return 0;
+	if (n < m) return n;
+	uint8_t last = q[m - 1];
+	const uint8_t *end = p + n;
+	for (const uint8_t *s = p + m - 1; s < end;) {
+		const uint8_t *hit = static_cast<const uint8_t*>(std::memchr(s, last, end - s));
+		if (hit == nullptr) break;
+		if (std::memcmp(hit - (m - 1), q, m - 1) == 0)
+			return hit - (m - 1) - p;
+		s = hit + 1;
+	}
+	return n;
+}
+
+#ifdef SIMD_X86
+
+inline uint64_t sumBytesSse2(const uint8_t *p, size_t n) {
+	__m128i zero = _mm_setzero_si128(), acc = zero;
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), zero));
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+	return lanes[0] + lanes[1] + sumBytesScalar(p + i, n - i);
+}
+
+inline void minMaxBytesSse2(const uint8_t *p, size_t n, uint8_t &min, uint8_t &max) {
+	__m128i lo = _mm_set1_epi8(-1), hi = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		lo = _mm_min_epu8(lo, x);
+		hi = _mm_max_epu8(hi, x);
+	}
+	uint8_t los[16], his[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(los), lo);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(his), hi);
+	minMaxBytesScalar(p + i, n - i, min, max);
+	for (int k = 0; k < 16; ++k) {
+		if (los[k] < min) min = los[k];
+		if (max < his[k]) max = his[k];
+	}
+}
+
+inline bool addInt64Sse2(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	__m128i overflow = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		__m128i z = _mm_add_epi64(x, y);
+		overflow = _mm_or_si128(overflow, _mm_and_si128(_mm_xor_si128(x, z), _mm_xor_si128(y, z)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), z);
+	}
+	bool ok = (_mm_movemask_pd(_mm_castsi128_pd(overflow)) == 0);
+	return addInt64Scalar(a + i, b + i, r + i, n - i) && ok;
+}
+
+inline bool subInt64Sse2(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	__m128i overflow = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		__m128i z = _mm_sub_epi64(x, y);
+		overflow = _mm_or_si128(overflow, _mm_and_si128(_mm_xor_si128(x, y), _mm_xor_si128(x, z)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), z);
+	}
+	bool ok = (_mm_movemask_pd(_mm_castsi128_pd(overflow)) == 0);
+	return subInt64Scalar(a + i, b + i, r + i, n - i) && ok;
+}
+
+inline void addBytesSse2(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), _mm_add_epi8(x, y));
+	}
+	addBytesScalar(a + i, b + i, r + i, n - i);
+}
+
+inline void subBytesSse2(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), _mm_sub_epi8(x, y));
+	}
+	subBytesScalar(a + i, b + i, r + i, n - i);
+}
+
+inline void fillInt64Sse2(int64_t *p, size_t n, int64_t v) {
+	__m128i x = _mm_set1_epi64x(v);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), x);
+	fillInt64Scalar(p + i, n - i, v);
+}
+
+// SSE2 has no 64-bit compare; both 32-bit halves must match.
+inline size_t findInt64Sse2(const int64_t *p, size_t n, int64_t v) {
+	__m128i key = _mm_set1_epi64x(v);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), key);
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + findInt64Scalar(p + i, n - i, v);
+}
+
+__attribute__((target("avx2")))
+inline void reduceInt64Avx2(const int64_t *p, size_t n, int64_t &sum, int64_t &min, int64_t &max) {
+	__m256i s = _mm256_setzero_si256();
+	__m256i lo = _mm256_set1_epi64x(p[0]), hi = lo;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		s = _mm256_add_epi64(s, x);
+		lo = _mm256_blendv_epi8(lo, x, _mm256_cmpgt_epi64(lo, x));
+		hi = _mm256_blendv_epi8(hi, x, _mm256_cmpgt_epi64(x, hi));
+	}
+	int64_t ss[4], los[4], his[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(ss), s);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(los), lo);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(his), hi);
+	uint64_t total = 0;
+	min = max = p[0];
+	for (int k = 0; k < 4; ++k) {
+		total += static_cast<uint64_t>(ss[k]);
+		if (los[k] < min) min = los[k];
+		if (max < his[k]) max = his[k];
+	}
+	if (i < n) {
+		int64_t restSum, restMin, restMax;
+		reduceInt64Scalar(p + i, n - i, restSum, restMin, restMax);
+		total += static_cast<uint64_t>(restSum);
+		if (restMin < min) min = restMin;
+		if (max < restMax) max = restMax;
+	}
+	sum = static_cast<int64_t>(total);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t sumBytesAvx2(const uint8_t *p, size_t n) {
+	__m256i zero = _mm256_setzero_si256(), acc = zero;
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), zero));
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumBytesScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void minMaxBytesAvx2(const uint8_t *p, size_t n, uint8_t &min, uint8_t &max) {
+	__m256i lo = _mm256_set1_epi8(-1), hi = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		lo = _mm256_min_epu8(lo, x);
+		hi = _mm256_max_epu8(hi, x);
+	}
+	uint8_t los[32], his[32];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(los), lo);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(his), hi);
+	minMaxBytesScalar(p + i, n - i, min, max);
+	for (int k = 0; k < 32; ++k) {
+		if (los[k] < min) min = los[k];
+		if (max < his[k]) max = his[k];
+	}
+}
+
+__attribute__((target("avx2")))
+inline bool addInt64Avx2(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	__m256i overflow = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		__m256i z = _mm256_add_epi64(x, y);
+		overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(x, z), _mm256_xor_si256(y, z)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), z);
+	}
+	bool ok = (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) == 0);
+	return addInt64Scalar(a + i, b + i, r + i, n - i) && ok;
+}
+
+__attribute__((target("avx2")))
+inline bool subInt64Avx2(const int64_t *a, const int64_t *b, int64_t *r, size_t n) {
+	__m256i overflow = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		__m256i z = _mm256_sub_epi64(x, y);
+		overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(x, y), _mm256_xor_si256(x, z)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), z);
+	}
+	bool ok = (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) == 0);
+	return subInt64Scalar(a + i, b + i, r + i, n - i) && ok;
+}
+
+__attribute__((target("avx2")))
+inline void addBytesAvx2(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), _mm256_add_epi8(x, y));
+	}
+	addBytesScalar(a + i, b + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void subBytesAvx2(const uint8_t *a, const uint8_t *b, uint8_t *r, size_t n) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), _mm256_sub_epi8(x, y));
+	}
+	subBytesScalar(a + i, b + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void fillInt64Avx2(int64_t *p, size_t n, int64_t v) {
+	__m256i x = _mm256_set1_epi64x(v);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), x);
+	fillInt64Scalar(p + i, n - i, v);
+}
+
+__attribute__((target("avx2")))
+inline size_t findInt64Avx2(const int64_t *p, size_t n, int64_t v) {
+	__m256i key = _mm256_set1_epi64x(v);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), key);
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + findInt64Scalar(p + i, n - i, v);
+}
+
+#endif
+
+struct Kernels {
+	const char *name;
+	void (*reduceInt64)(const int64_t *, size_t, int64_t &, int64_t &, int64_t &);
+	uint64_t (*sumBytes)(const uint8_t *, size_t);
+	void (*minMaxBytes)(const uint8_t *, size_t, uint8_t &, uint8_t &);
+	bool (*addInt64)(const int64_t *, const int64_t *, int64_t *, size_t);
+	bool (*subInt64)(const int64_t *, const int64_t *, int64_t *, size_t);
+	void (*addBytes)(const uint8_t *, const uint8_t *, uint8_t *, size_t);
+	void (*subBytes)(const uint8_t *, const uint8_t *, uint8_t *, size_t);
+	void (*fillInt64)(int64_t *, size_t, int64_t);
+	size_t (*findInt64)(const int64_t *, size_t, int64_t);
+};
+
+inline Kernels selectKernels() {
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		Kernels k = {"avx2", reduceInt64Avx2, sumBytesAvx2, minMaxBytesAvx2,
+								 addInt64Avx2, subInt64Avx2, addBytesAvx2, subBytesAvx2,
+								 fillInt64Avx2, findInt64Avx2};
+		return k;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		Kernels k = {"sse2", reduceInt64Scalar, sumBytesSse2, minMaxBytesSse2,
+								 addInt64Sse2, subInt64Sse2, addBytesSse2, subBytesSse2,
+								 fillInt64Sse2, findInt64Sse2};
+		return k;
+	}
+#endif
+	Kernels k = {"scalar", reduceInt64Scalar, sumBytesScalar, minMaxBytesScalar,
+							 addInt64Scalar, subInt64Scalar, addBytesScalar, subBytesScalar,
+							 fillInt64Scalar, findInt64Scalar};
+	return k;
+}
+
+inline const Kernels &kernels() {
+	static const Kernels k = selectKernels();
+	return k;
+}
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+// Every worker owns a deque: it pushes and pops its own tasks at the back
+// and steals from the front of the others when it runs dry. Tasks submitted
+// from outside the pool go to a shared injection queue. A thread that waits
+// for a result helps by running queued tasks, so nested parallel calls
+// cannot deadlock the pool. Tasks must not throw.
+
+class ThreadPool {
+	typedef std::function<void()> Task;
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	struct Worker {
+		ThreadPool *pool;
+		size_t index;
+	};
+
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> threads;
+	std::atomic<bool> stopping;
+	std::atomic<size_t> pending;
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+
+	static Worker &self() {
+		thread_local Worker worker = {nullptr, 0};
+		return worker;
+	}
+
+	bool take(size_t i, bool back, Task &task) {
+		Queue &q = *queues[i];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty()) return false;
+		if (back) {
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+		} else {
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		--pending;
+		return true;
+	}
+
+	void work(size_t index) {
+		self().pool = this;
+		self().index = index;
+		while (!stopping) {
+			if (runOne()) continue;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wake.wait(lock, [this] { return stopping || pending > 0; });
+		}
+	}
+
+public:
+	explicit ThreadPool(size_t n)
+	: stopping(false), pending(0) {
+		if (n == 0) n = 1;
+		for (size_t i = 0; i <= n; ++i)
+			queues.emplace_back(new Queue());
+		for (size_t i = 0; i < n; ++i)
+			threads.emplace_back(&ThreadPool::work, this, i);
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread &t : threads)
+			t.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool &operator=(const ThreadPool&) = delete;
+
+	size_t size() const { return threads.size(); }
+
+	void submit(Task task) {
+		size_t i = self().pool == this ? self().index : queues.size() - 1;
+		{
+			std::lock_guard<std::mutex> lock(queues[i]->mutex);
+			queues[i]->tasks.push_back(std::move(task));
+			++pending;
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+
+	// Runs one queued task, preferring the caller's own newest task.
+	// Returns false if every queue was empty.
+	bool runOne() {
+		Task task;
+		size_t n = queues.size();
+		size_t start = self().pool == this ? self().index : n - 1;
+		bool found = take(start, true, task);
+		for (size_t k = 1; !found && k < n; ++k)
+			found = take((start + k) % n, false, task);
+		if (!found) return false;
+		task();
+		return true;
+	}
+
+	// Runs queued tasks until `done` returns true. Backs off to short sleeps
+	// while nothing is queued so a long wait does not spin a core.
+	template <typename Pred>
+	void helpUntil(Pred done) {
+		for (unsigned idle = 0; !done();) {
+			if (runOne())
+				idle = 0;
+			else if (++idle < 64)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	static ThreadPool &shared() {
+		static ThreadPool pool(std::thread::hardware_concurrency());
+		return pool;
+	}
+};
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Summarizes a heap dump written by (heap-dump "file") or by SIGUSR1.
+
+    python3 tools/heap_analyze.py heap.jsonl [--top N]
+
+Prints, for each type, the number of objects, their own size and the size
+they retain: what would be freed if they went away. Then prints the objects
+retaining the most memory with the path from a root that keeps each alive.
+The path follows dominators, so every object on it is one that all
+references to the object go through.
+"""
+
+import argparse
+import json
+import sys
+from collections import defaultdict
+
+
+def load(path):
+    nodes = {}
+    with open(path) as f:
+        header = json.loads(f.readline())
+        if header.get("format") != "lisp-heap":
+            sys.exit("%s: not a heap dump" % path)
+        for line in f:
+            node = json.loads(line)
+            nodes[node["id"]] = node
+    return nodes
+
+
+def dominators(nodes):
+    """Immediate dominators from a virtual root 0 pointing to every root,
+    computed with the iterative algorithm of Cooper, Harvey and Kennedy."""
+    succ = {0: [i for i, n in nodes.items() if "root" in n]}
+    for i, n in nodes.items():
+        succ[i] = n["refs"]
+
+    order = []
+    seen = {0}
+    stack = [(0, iter(succ[0]))]
+    while stack:
+        node, it = stack[-1]
+        for child in it:
+            if child not in seen:
+                seen.add(child)
+                stack.append((child, iter(succ[child])))
+                break
+        else:
+            stack.pop()
+            order.append(node)
+    order.reverse()
+    index = {n: i for i, n in enumerate(order)}
+
+    preds = defaultdict(list)
+    for n in order:
+        for child in succ[n]:
+            preds[child].append(n)
+
+    idom = {0: 0}
+
+    def intersect(a, b):
+        while a != b:
+            while index[a] > index[b]:
+                a = idom[a]
+            while index[b] > index[a]:
+                b = idom[b]
+        return a
+
+    changed = True
+    while changed:
+        changed = False
+        for n in order[1:]:
+            new = None
+            for p in preds[n]:
+                if p in idom:
+                    new = p if new is None else intersect(p, new)
+            if idom.get(n) != new:
+                idom[n] = new
+                changed = True
+    return order, idom
+
+
+def describe(node):
+    if "name" in node:
+        return "%s %s" % (node["type"], node["name"])
+    return "%s #%d" % (node["type"], node["id"])
+
+
+def size_str(n):
+    for unit in ("B", "KB", "MB"):
+        if n < 1024 or unit == "MB":
+            return "%d %s" % (n, unit) if unit == "B" else "%.1f %s" % (n, unit)
+        n /= 1024.0
+
+
+def retainer_path(nodes, idom, i):
+    chain = []
+    while i != 0:
+        chain.append(i)
+        i = idom[i]
+    chain.reverse()
+    parts = ["<%s>" % nodes[chain[0]]["root"]]
+    k = 0
+    while k < len(chain):
+        j = k
+        while j + 1 < len(chain) and nodes[chain[j + 1]]["type"] == nodes[chain[k]]["type"] \
+                and "name" not in nodes[chain[j + 1]]:
+            j += 1
+        if j > k:
+            parts.append("%s x%d" % (nodes[chain[k]]["type"], j - k + 1))
+        else:
+            parts.append(describe(nodes[chain[k]]))
+        k = j + 1
+    return " -> ".join(parts)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("dump")
+    parser.add_argument("--top", type=int, default=10)
+    args = parser.parse_args()
+
+    nodes = load(args.dump)
+    order, idom = dominators(nodes)
+
+    retained = {i: n["size"] for i, n in nodes.items()}
+    for n in reversed(order[1:]):
+        if idom[n] != 0:
+            retained[idom[n]] += retained[n]
+
+    # An object counts towards its type's retained size unless an object of
+    # the same type already retains it, so that a list is counted once
+    # rather than once per cell.
+    types = defaultdict(lambda: [0, 0, 0])
+    for i, n in nodes.items():
+        t = types[n["type"]]
+        t[0] += 1
+        t[1] += n["size"]
+        if i in idom and (idom[i] == 0 or nodes[idom[i]]["type"] != n["type"]):
+            t[2] += retained[i]
+
+    total = sum(n["size"] for n in nodes.values())
+    print("%d objects, %s" % (len(nodes), size_str(total)))
+    unreachable = len(nodes) - (len(order) - 1)
+    if unreachable:
+        print("%d objects not reachable from a root" % unreachable)
+    print()
+    print("%-20s %10s %12s %12s" % ("type", "count", "size", "retained"))
+    for name, (count, size, ret) in sorted(types.items(), key=lambda kv: -kv[1][2]):
+        print("%-20s %10d %12s %12s" % (name, count, size_str(size), size_str(ret)))
+
+    print()
+    print("Top retainers:")
+    # Each entry is followed down while one object holds nearly all of it,
+    # so that the path ends where the memory actually is. Objects under an
+    # entry already shown are skipped.
+    children = defaultdict(list)
+    for i in order[1:]:
+        children[idom[i]].append(i)
+    shown = set()
+    for i in sorted(order[1:], key=lambda i: -retained[i]):
+        if len(shown) == args.top:
+            break
+        j = idom[i]
+        while j != 0 and j not in shown:
+            j = idom[j]
+        if j != 0:
+            continue
+        shown.add(i)
+        end = i
+        while True:
+            big = [c for c in children[end] if retained[c] * 10 >= retained[end] * 9]
+            if not big:
+                break
+            end = big[0]
+        print("%12s  %s" % (size_str(retained[i]), retainer_path(nodes, idom, end)))
+
+if __name__ == "__main__":
+    main()
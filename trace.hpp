@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Low-overhead evaluation tracer.
+// Events are recorded into a per-thread ring buffer and written out as
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev) on demand.
+// While tracing is disabled every hook is a single relaxed load.
+
+namespace trace {
+
+enum Category : uint8_t { CALL, BUILTIN, MACRO, LOAD, ENV };
+
+struct Event {
+	uint64_t ts;
+	char phase;
+	uint8_t category;
+	char name[22];
+};
+
+struct Buffer {
+	static const size_t capacity = 1 << 16;
+
+	std::vector<Event> events;
+	size_t head = 0;
+	size_t size = 0;
+	int tid;
+	// Only contended while start() or stop() touches the buffer.
+	std::mutex mutex;
+
+	Buffer(int t) : events(capacity), tid(t) {}
+
+	void push(char phase, uint8_t category, const char *name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Event &e = events[head];
+		e.ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		e.phase = phase;
+		e.category = category;
+		std::strncpy(e.name, name, sizeof(e.name) - 1);
+		e.name[sizeof(e.name) - 1] = 0;
+		head = (head + 1) % capacity;
+		if (size < capacity) ++size;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		head = size = 0;
+	}
+};
+
+template <typename D = void>
+struct State {
+	static std::atomic<bool> enabled;
+	static std::mutex mutex;
+	static std::vector<std::shared_ptr<Buffer> > buffers;
+};
+template <typename D> std::atomic<bool> State<D>::enabled(false);
+template <typename D> std::mutex State<D>::mutex;
+template <typename D> std::vector<std::shared_ptr<Buffer> > State<D>::buffers;
+
+inline bool enabled() {
+	return State<>::enabled.load(std::memory_order_relaxed);
+}
+
+inline Buffer &threadBuffer() {
+	thread_local std::shared_ptr<Buffer> buffer;
+	if (buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(State<>::mutex);
+		buffer = std::make_shared<Buffer>(State<>::buffers.size() + 1);
+		State<>::buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+inline void record(char phase, uint8_t category, const char *name) {
+	if (enabled())
+		threadBuffer().push(phase, category, name);
+}
+
+inline void instant(uint8_t category, const char *name) {
+	record('i', category, name);
+}
+
+// Emits a begin event now and the matching end event when it goes out of scope.
+class Scope {
+	const char *name;
+	uint8_t category;
+	bool active;
+
+public:
+	Scope(uint8_t c, const char *n) : name(n), category(c), active(enabled()) {
+		if (active) threadBuffer().push('B', category, name);
+	}
+	~Scope() {
+		if (active) threadBuffer().push('E', category, name);
+	}
+};
+
+inline void start() {
+	std::lock_guard<std::mutex> lock(State<>::mutex);
+	for (auto &buffer : State<>::buffers)
+		buffer->clear();
+	State<>::enabled.store(true);
+}
+
+inline void writeJsonString(std::ostream &os, const char *s) {
+	os << '"';
+	for (; *s; ++s) {
+		char c = *s;
+		if (c == '"' || c == '\\')
+			os << '\\' << c;
+		else if (static_cast<unsigned char>(c) < 0x20)
+			os << ' ';
+		else
+			os << c;
+	}
+	os << '"';
+}
+
+// Disables tracing and writes every buffered event to `filename`.
+// Once a buffer has wrapped around, the oldest begin events are gone;
+// end events left without their begin are skipped so that the trace
+// stays balanced.
+inline bool stop(const std::string &filename) {
+	static const char *categoryNames[] = {"call", "builtin", "macro", "load", "env"};
+	State<>::enabled.store(false);
+	std::ofstream ofs(filename);
+	if (ofs.fail()) return false;
+	std::lock_guard<std::mutex> lock(State<>::mutex);
+	ofs << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	for (auto &buffer : State<>::buffers) {
+		std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+		size_t depth = 0;
+		size_t start = (buffer->head + Buffer::capacity - buffer->size) % Buffer::capacity;
+		for (size_t i = 0; i < buffer->size; ++i) {
+			const Event &e = buffer->events[(start + i) % Buffer::capacity];
+			if (e.phase == 'B') {
+				++depth;
+			} else if (e.phase == 'E') {
+				if (depth == 0) continue;
+				--depth;
+			}
+			ofs << (first ? "\n" : ",\n") << "{\"name\":";
+			writeJsonString(ofs, e.name);
+			ofs << ",\"cat\":\"" << categoryNames[e.category]
+					<< "\",\"ph\":\"" << e.phase
+					<< "\",\"ts\":" << e.ts / 1000 << '.' << (e.ts / 100) % 10 << (e.ts / 10) % 10 << e.ts % 10
+					<< ",\"pid\":1,\"tid\":" << buffer->tid;
+			if (e.phase == 'i') ofs << ",\"s\":\"t\"";
+			ofs << "}";
+			first = false;
+		}
+		buffer->head = buffer->size = 0;
+	}
+	ofs << "\n]}\n";
+	return !ofs.fail();
+}
+
+}